@@ -0,0 +1,581 @@
+/*
+ * cache.c: content addressed cache of substitution results
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define STATS_NAME "stats"
+#define TMP_PREFIX "tmp."
+/* Seconds after which a temporary entry is left over from a crashed store */
+#define TMP_MAX_AGE 3600
+/* Marks an input that passes through unchanged, no output is stored */
+#define SAME_SUFFIX ".same"
+#define ENTRY_NAME_SIZE (CACHE_KEY_LEN + sizeof(SAME_SUFFIX))
+/* Evicting below the limit keeps a full cache from rescanning every store */
+#define EVICT_PERCENT 90
+
+struct cache {
+	int dir_fd;
+	size_t max_size, block_size;
+	uint64_t rules_hash;
+};
+
+/*
+ * A streaming XXH64, fast enough that hashing the input costs little
+ * next to substituting it.
+ */
+static const uint64_t P1 = 11400714785074694791ULL;
+static const uint64_t P2 = 14029467366897019727ULL;
+static const uint64_t P3 = 1609587929392839161ULL;
+static const uint64_t P4 = 9650029242287828579ULL;
+static const uint64_t P5 = 2870177450012600261ULL;
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = rotl64(acc, 31);
+	return acc * P1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= hash_round(0, val);
+	return acc * P1 + P4;
+}
+
+void hash64_init(struct hash64 *hash, uint64_t seed)
+{
+	hash->v[0] = seed + P1 + P2;
+	hash->v[1] = seed + P2;
+	hash->v[2] = seed;
+	hash->v[3] = seed - P1;
+	hash->total_len = 0;
+	hash->mem_len = 0;
+}
+
+static void hash64_stripe(struct hash64 *hash, const unsigned char *p)
+{
+	for (size_t i = 0; i < 4; ++i)
+		hash->v[i] = hash_round(hash->v[i], read64(p + i * 8));
+}
+
+void hash64_update(struct hash64 *hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	hash->total_len += len;
+
+	if (hash->mem_len + len < 32) {
+		memcpy(hash->mem + hash->mem_len, p, len);
+		hash->mem_len += len;
+		return;
+	}
+	if (hash->mem_len > 0) {
+		size_t fill = 32 - hash->mem_len;
+		memcpy(hash->mem + hash->mem_len, p, fill);
+		hash64_stripe(hash, hash->mem);
+		p += fill;
+		len -= fill;
+		hash->mem_len = 0;
+	}
+	for (; len >= 32; p += 32, len -= 32)
+		hash64_stripe(hash, p);
+	memcpy(hash->mem, p, len);
+	hash->mem_len = len;
+}
+
+uint64_t hash64_digest(const struct hash64 *hash)
+{
+	const unsigned char *p = hash->mem, *end = hash->mem + hash->mem_len;
+	uint64_t h;
+
+	if (hash->total_len >= 32) {
+		h = rotl64(hash->v[0], 1) + rotl64(hash->v[1], 7) +
+			rotl64(hash->v[2], 12) + rotl64(hash->v[3], 18);
+		for (size_t i = 0; i < 4; ++i)
+			h = hash_merge(h, hash->v[i]);
+	} else {
+		h = hash->v[2] + P5;
+	}
+	h += hash->total_len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= hash_round(0, read64(p));
+		h = rotl64(h, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * P1;
+		h = rotl64(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= *p * P5;
+		h = rotl64(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static bool hash_rule(const wchar_t key[], size_t key_size, void *value,
+		void *data)
+{
+	const struct substitution *sub = value;
+	hash64_update(data, &key_size, sizeof(key_size));
+	hash64_update(data, key, key_size * sizeof(wchar_t));
+	hash64_update(data, &sub->replacement_len, sizeof(sub->replacement_len));
+	hash64_update(data, sub->replacement, sub->replacement_len);
+	hash64_update(data, &sub->max_replacements,
+			sizeof(sub->max_replacements));
+	return true;
+}
+
+struct cache *cache_open(const char *dir, size_t max_size,
+		pfx_tree_t substitutions, const struct substitute_opts *opts)
+{
+	struct cache *cache = malloc(sizeof(struct cache));
+	struct hash64 hash;
+	if (cache == NULL)
+		return NULL;
+
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+		goto cache_open_free;
+	cache->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (cache->dir_fd == -1)
+		goto cache_open_free;
+	cache->max_size = max_size;
+	cache->block_size = opts->block_size > 0 ?
+		opts->block_size : DEFAULT_BLOCK_SIZE;
+
+	/* Everything that changes the output for a given input */
+	hash64_init(&hash, 1);
+	hash64_update(&hash, pfx_tree_fold_table(substitutions), 256);
+	hash64_update(&hash, &opts->decompress, sizeof(opts->decompress));
+	hash64_update(&hash, &opts->compress, sizeof(opts->compress));
+	hash64_update(&hash, &opts->max_replacements,
+			sizeof(opts->max_replacements));
+	if (!pfx_tree_walk(substitutions, hash_rule, &hash))
+		goto cache_open_close;
+	cache->rules_hash = hash64_digest(&hash);
+	return cache;
+
+cache_open_close:
+	close(cache->dir_fd);
+cache_open_free:
+	free(cache);
+	return NULL;
+}
+
+void cache_close(struct cache *cache)
+{
+	if (cache == NULL)
+		return;
+	close(cache->dir_fd);
+	free(cache);
+}
+
+/*
+ * Makes dest a copy of src_fd, sharing its blocks through a reflink when
+ * the filesystem supports it. Hard links are never used as the output may
+ * later be truncated and rewritten in place, corrupting the entry.
+ */
+static bool clone_file(int src_fd, int dest_dir, const char *dest_name)
+{
+	bool ret;
+	int dest_fd = openat(dest_dir, dest_name,
+			O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (dest_fd == -1)
+		return false;
+
+	ret = ioctl(dest_fd, FICLONE, src_fd) == 0 || copy_fd(dest_fd, src_fd, SIZE_MAX);
+	if (close(dest_fd) == -1)
+		ret = false;
+	return ret;
+}
+
+static bool hash_fd(int fd, size_t block_size, uint64_t *digest)
+{
+	struct hash64 hash;
+	off_t offset = 0;
+	ssize_t bytes;
+	char *buf = malloc(block_size);
+	if (buf == NULL)
+		return false;
+
+	hash64_init(&hash, 0);
+	while ((bytes = pread(fd, buf, block_size, offset)) > 0) {
+		hash64_update(&hash, buf, bytes);
+		offset += bytes;
+	}
+	free(buf);
+	if (bytes == -1)
+		return false;
+	*digest = hash64_digest(&hash);
+	return true;
+}
+
+/*
+ * The stats file holds the hit and miss counts and the bytes stored in the
+ * cache, the last missing from files written by older versions.
+ */
+struct cache_stats {
+	unsigned long long hits, misses, size;
+	bool sized;
+};
+
+/*
+ * Opens and locks the stats file, reading in its counts.
+ * @return The locked descriptor to pass to stats_unlock, or -1
+ */
+static int stats_lock(struct cache *cache, struct cache_stats *stats)
+{
+	char buf[96];
+	ssize_t bytes;
+	int fd = openat(cache->dir_fd, STATS_NAME, O_RDWR | O_CREAT, 0666);
+	if (fd == -1)
+		return -1;
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	*stats = (struct cache_stats) { .hits = 0 };
+	bytes = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (bytes > 0) {
+		buf[bytes] = '\0';
+		stats->sized = sscanf(buf, "%llu %llu %llu", &stats->hits,
+				&stats->misses, &stats->size) == 3;
+	}
+	return fd;
+}
+
+/*
+ * Writes back the counts and releases the stats file. A size never
+ * measured is left out rather than written as 0.
+ */
+static void stats_unlock(int fd, const struct cache_stats *stats)
+{
+	char buf[96];
+	ssize_t bytes = stats->sized ?
+		snprintf(buf, sizeof(buf), "%llu %llu %llu\n", stats->hits,
+				stats->misses, stats->size) :
+		snprintf(buf, sizeof(buf), "%llu %llu\n", stats->hits,
+				stats->misses);
+	if (ftruncate(fd, 0) == 0)
+		bytes = pwrite(fd, buf, bytes, 0);
+	close(fd);
+}
+
+static void record_stats(struct cache *cache, bool hit)
+{
+	struct cache_stats stats;
+	int fd = stats_lock(cache, &stats);
+	if (fd == -1)
+		return;
+	stats.hits += hit;
+	stats.misses += !hit;
+	stats_unlock(fd, &stats);
+}
+
+/*
+ * Produces dest from the cache if the input has been seen with the same
+ * rules before, otherwise fills in the key to store the result under.
+ * @return 1 on a hit, 0 on a miss and -1 if the cache could not be used
+ */
+int cache_fetch(struct cache *cache, int in_fd, const char *dest_fn,
+		struct cache_key *key)
+{
+	char same_name[ENTRY_NAME_SIZE];
+	uint64_t in_hash;
+	struct stat st;
+	int entry_fd;
+
+	key->name[0] = '\0';
+	/* Only regular files can be read twice */
+	if (fstat(in_fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+	if (!hash_fd(in_fd, cache->block_size, &in_hash))
+		return -1;
+	snprintf(key->name, sizeof(key->name), "%016" PRIx64 "%016" PRIx64,
+			in_hash, cache->rules_hash);
+	snprintf(same_name, sizeof(same_name), "%s" SAME_SUFFIX, key->name);
+
+	entry_fd = openat(cache->dir_fd, key->name, O_RDONLY);
+	if (entry_fd != -1) {
+		bool placed = clone_file(entry_fd, AT_FDCWD, dest_fn);
+		/* Refreshing the mtime keeps eviction least recently used */
+		futimens(entry_fd, NULL);
+		close(entry_fd);
+		if (!placed)
+			return -1;
+		record_stats(cache, true);
+		return 1;
+	}
+
+	entry_fd = openat(cache->dir_fd, same_name, O_RDONLY);
+	if (entry_fd != -1) {
+		futimens(entry_fd, NULL);
+		close(entry_fd);
+		if (!clone_file(in_fd, AT_FDCWD, dest_fn))
+			return -1;
+		record_stats(cache, true);
+		return 1;
+	}
+
+	record_stats(cache, false);
+	return 0;
+}
+
+struct cache_entry {
+	char name[ENTRY_NAME_SIZE];
+	off_t size;
+	struct timespec mtime;
+};
+
+static bool is_entry_name(const char *name)
+{
+	return name[0] != '.' && strcmp(name, STATS_NAME) != 0 &&
+		strncmp(name, TMP_PREFIX, strlen(TMP_PREFIX)) != 0 &&
+		strlen(name) < ENTRY_NAME_SIZE;
+}
+
+/*
+ * Lists the entries, also removing temporaries left by stores that never
+ * finished when reap is set.
+ * @return The number of entries found, or -1 on error
+ */
+static ssize_t list_entries(struct cache *cache, struct cache_entry **entries,
+		off_t *total, bool reap)
+{
+	time_t now = time(NULL);
+	size_t count = 0, size = 16;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	/* A dup would share the read offset with other listing threads */
+	int dir_fd = openat(cache->dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (dir_fd == -1)
+		return -1;
+	dir = fdopendir(dir_fd);
+	if (dir == NULL) {
+		close(dir_fd);
+		return -1;
+	}
+
+	*total = 0;
+	*entries = malloc(size * sizeof(struct cache_entry));
+	if (*entries == NULL)
+		goto list_fail;
+	while ((ent = readdir(dir)) != NULL) {
+		if (reap && strncmp(ent->d_name, TMP_PREFIX,
+					strlen(TMP_PREFIX)) == 0 &&
+				fstatat(cache->dir_fd, ent->d_name, &st, 0) == 0 &&
+				st.st_mtime + TMP_MAX_AGE < now) {
+			unlinkat(cache->dir_fd, ent->d_name, 0);
+			continue;
+		}
+		if (!is_entry_name(ent->d_name) ||
+				fstatat(cache->dir_fd, ent->d_name, &st, 0) == -1)
+			continue;
+		if (count == size) {
+			struct cache_entry *resized = realloc(*entries,
+					(size <<= 1) * sizeof(struct cache_entry));
+			if (resized == NULL)
+				goto list_fail;
+			*entries = resized;
+		}
+		strcpy((*entries)[count].name, ent->d_name);
+		(*entries)[count].size = st.st_size;
+		(*entries)[count].mtime = st.st_mtim;
+		*total += st.st_size;
+		++count;
+	}
+	closedir(dir);
+	return count;
+
+list_fail:
+	free(*entries);
+	*entries = NULL;
+	closedir(dir);
+	return -1;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct timespec *ta = &((const struct cache_entry *)a)->mtime;
+	const struct timespec *tb = &((const struct cache_entry *)b)->mtime;
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec ? -1 : 1;
+	if (ta->tv_nsec != tb->tv_nsec)
+		return ta->tv_nsec < tb->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Drops the least recently used entries until the cache is back under
+ * EVICT_PERCENT of max_size, so the next scan is some stores away.
+ * @return The bytes left in the cache, or -1 if it could not be listed
+ */
+static off_t evict(struct cache *cache)
+{
+	struct cache_entry *entries;
+	off_t total, target = cache->max_size / 100 * EVICT_PERCENT;
+	ssize_t count = list_entries(cache, &entries, &total, true);
+	if (count == -1)
+		return -1;
+
+	if (total > (off_t)cache->max_size) {
+		qsort(entries, count, sizeof(struct cache_entry), entry_cmp);
+		for (ssize_t i = 0; i < count && total > target; ++i)
+			if (unlinkat(cache->dir_fd, entries[i].name, 0) == 0)
+				total -= entries[i].size;
+	}
+	free(entries);
+	return total;
+}
+
+/*
+ * Records the output produced for key. Failures only cost a future miss,
+ * so they are not reported.
+ */
+void cache_store(struct cache *cache, const struct cache_key *key,
+		const char *dest_fn, bool unchanged)
+{
+	struct cache_stats stats;
+	char tmp_name[96];
+	off_t entry_size = 0, total;
+	struct stat st;
+	int fd;
+
+	if (key->name[0] == '\0')
+		return;
+
+	if (unchanged) {
+		char same_name[ENTRY_NAME_SIZE];
+		snprintf(same_name, sizeof(same_name), "%s" SAME_SUFFIX, key->name);
+		fd = openat(cache->dir_fd, same_name, O_WRONLY | O_CREAT, 0444);
+		if (fd != -1)
+			close(fd);
+	} else {
+		fd = open(dest_fn, O_RDONLY);
+		if (fd == -1)
+			return;
+		/*
+		 * Build under a private name so readers never see a partial entry,
+		 * the thread keeps it private between the server's workers
+		 */
+		snprintf(tmp_name, sizeof(tmp_name), TMP_PREFIX "%ld.%ld.%s",
+				(long)getpid(), (long)gettid(), key->name);
+		if (clone_file(fd, cache->dir_fd, tmp_name) &&
+				renameat(cache->dir_fd, tmp_name, cache->dir_fd,
+					key->name) == 0) {
+			if (fstat(fd, &st) == 0)
+				entry_size = st.st_size;
+		} else {
+			unlinkat(cache->dir_fd, tmp_name, 0);
+		}
+		close(fd);
+	}
+
+	/*
+	 * The running total only overcounts, as when an entry is replaced, so
+	 * the directory is scanned once it looks too big and the real size
+	 * written back.
+	 */
+	fd = stats_lock(cache, &stats);
+	if (fd == -1)
+		return;
+	stats.size += entry_size;
+	if (cache->max_size > 0 &&
+			(!stats.sized || stats.size > cache->max_size)) {
+		total = evict(cache);
+		stats.sized = total != -1;
+		stats.size = total;
+	}
+	stats_unlock(fd, &stats);
+}
+
+bool cache_print_stats(struct cache *cache, FILE *out)
+{
+	unsigned long long hits = 0, misses = 0;
+	struct cache_entry *entries;
+	off_t total;
+	FILE *stats;
+
+	int fd = openat(cache->dir_fd, STATS_NAME, O_RDONLY);
+	if (fd != -1 && (stats = fdopen(fd, "r")) != NULL) {
+		flock(fd, LOCK_SH);
+		if (fscanf(stats, "%llu %llu", &hits, &misses) != 2)
+			hits = misses = 0;
+		fclose(stats);
+	} else if (fd != -1) {
+		close(fd);
+	}
+
+	ssize_t count = list_entries(cache, &entries, &total, false);
+	if (count == -1)
+		return false;
+	free(entries);
+
+	fprintf(out, "Cache: %llu hits, %llu misses (%.1f%% hit rate), "
+			"%zd entries using %lld bytes\n", hits, misses,
+			hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+			count, (long long)total);
+	return true;
+}
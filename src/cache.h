@@ -0,0 +1,64 @@
+/*
+ * cache.h: content addressed cache of substitution results
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pfx_tree.h"
+#include "util.h"
+
+struct hash64 {
+	uint64_t v[4];
+	uint64_t total_len;
+	unsigned char mem[32];
+	size_t mem_len;
+};
+
+void hash64_init(struct hash64 *hash, uint64_t seed);
+void hash64_update(struct hash64 *hash, const void *data, size_t len);
+uint64_t hash64_digest(const struct hash64 *hash);
+
+/* Hex digits of the input hash followed by those of the rule set hash */
+#define CACHE_KEY_LEN 32
+
+struct cache_key {
+	char name[CACHE_KEY_LEN + 1];
+};
+
+struct cache *cache_open(const char *dir, size_t max_size,
+		pfx_tree_t substitutions, const struct substitute_opts *opts);
+void cache_close(struct cache *cache);
+
+int cache_fetch(struct cache *cache, int in_fd, const char *dest_fn,
+		struct cache_key *key);
+void cache_store(struct cache *cache, const struct cache_key *key,
+		const char *dest_fn, bool unchanged);
+bool cache_print_stats(struct cache *cache, FILE *out);
+
+#endif // CACHE_H
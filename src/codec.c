@@ -0,0 +1,695 @@
+/*
+ * codec.c: threaded compression and decompression pipelines
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+#include "ring_buf.h"
+#include "util.h"
+
+/* Number of blocks in flight between the two threads of a pipeline */
+#define PIPELINE_BLOCKS 4
+
+struct chunk {
+	char *data;
+	/* A chunk without data marks the end of the stream */
+	size_t len;
+};
+
+struct chunk_queue {
+	/* One extra slot so the end of stream marker always fits */
+	struct chunk items[PIPELINE_BLOCKS + 1];
+	size_t head, count;
+};
+
+/*
+ * Full chunks travel from the producer to the consumer and are recycled
+ * through the empty queue, so no data is copied between the threads.
+ */
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk_queue full, empty;
+	bool aborted;
+	int error;
+
+	char *blocks;
+	size_t block_size;
+	int fd;
+	enum codec codec;
+	pthread_t thread;
+};
+
+struct codec_reader {
+	struct pipeline pipe;
+	char *prefix;
+	size_t prefix_len;
+	struct chunk cur;
+	size_t cur_offset;
+	bool eof;
+};
+
+struct codec_writer {
+	struct pipeline pipe;
+};
+
+enum codec codec_detect(const unsigned char *magic, size_t len)
+{
+	/* Deflate is the only method, and the top flag bits are reserved */
+	if (len >= 4 && magic[0] == 0x1f && magic[1] == 0x8b &&
+			magic[2] == 0x08 && (magic[3] & 0xe0) == 0)
+		return CODEC_GZIP;
+	if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+			magic[2] == 0x2f && magic[3] == 0xfd)
+		return CODEC_ZSTD;
+	return CODEC_NONE;
+}
+
+bool codec_from_name(const char *name, enum codec *codec)
+{
+	if (strcmp(name, "gzip") == 0 || strcmp(name, "gz") == 0)
+		*codec = CODEC_GZIP;
+	else if (strcmp(name, "zstd") == 0 || strcmp(name, "zst") == 0)
+		*codec = CODEC_ZSTD;
+	else
+		return false;
+	return true;
+}
+
+bool codec_supported(enum codec codec)
+{
+	switch (codec) {
+		case CODEC_NONE:
+			return true;
+#ifdef HAVE_ZLIB
+		case CODEC_GZIP:
+			return true;
+#endif
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static void queue_push(struct pipeline *pipe, struct chunk_queue *queue,
+		struct chunk chunk)
+{
+	pthread_mutex_lock(&pipe->lock);
+	queue->items[(queue->head + queue->count) % (PIPELINE_BLOCKS + 1)] = chunk;
+	++queue->count;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+ * Blocks until a chunk is available.
+ * @return false if the pipeline was aborted, with errno set to the cause
+ */
+static bool queue_pop(struct pipeline *pipe, struct chunk_queue *queue,
+		struct chunk *chunk)
+{
+	bool ret = false;
+	pthread_mutex_lock(&pipe->lock);
+	while (queue->count == 0 && !pipe->aborted)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	if (!pipe->aborted) {
+		*chunk = queue->items[queue->head];
+		queue->head = (queue->head + 1) % (PIPELINE_BLOCKS + 1);
+		--queue->count;
+		ret = true;
+	} else {
+		errno = pipe->error;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return ret;
+}
+
+static void pipeline_fail(struct pipeline *pipe, int error)
+{
+	pthread_mutex_lock(&pipe->lock);
+	if (!pipe->aborted) {
+		pipe->error = error;
+		pipe->aborted = true;
+	}
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static bool pipeline_init(struct pipeline *pipe, int fd, enum codec codec,
+		size_t block_size)
+{
+	if (!codec_supported(codec) || codec == CODEC_NONE) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	pipe->blocks = block_alloc(block_size * PIPELINE_BLOCKS, false);
+	if (pipe->blocks == NULL)
+		return false;
+
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	pipe->full.head = pipe->full.count = 0;
+	pipe->empty.head = pipe->empty.count = 0;
+	pipe->aborted = false;
+	pipe->error = 0;
+	pipe->block_size = block_size;
+	pipe->fd = fd;
+	pipe->codec = codec;
+
+	for (size_t i = 0; i < PIPELINE_BLOCKS; ++i)
+		queue_push(pipe, &pipe->empty, (struct chunk) {
+				.data = pipe->blocks + i * block_size,
+				.len = 0
+		});
+	return true;
+}
+
+static void pipeline_destroy(struct pipeline *pipe)
+{
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	block_free(pipe->blocks, pipe->block_size * PIPELINE_BLOCKS, false);
+}
+
+static ssize_t read_some(int fd, char *buf, size_t count)
+{
+	ssize_t ret;
+	do {
+		ret = read(fd, buf, count);
+	} while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+/*
+ * Hands a full output chunk to the consumer and takes an empty one,
+ * dropping the full one if it holds no data.
+ */
+static bool reader_swap(struct pipeline *pipe, struct chunk *out, size_t len)
+{
+	if (len == 0)
+		return true;
+	out->len = len;
+	queue_push(pipe, &pipe->full, *out);
+	return queue_pop(pipe, &pipe->empty, out);
+}
+
+#ifdef HAVE_ZLIB
+static bool gzip_decompress(struct codec_reader *reader, char *in,
+		size_t in_len, struct chunk *out)
+{
+	struct pipeline *pipe = &reader->pipe;
+	z_stream zs = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	bool eof = false, ret = false;
+	int zret = Z_OK;
+
+	/* 32 enables automatic gzip / zlib header detection */
+	if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+		errno = ENOMEM;
+		return false;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = in_len;
+	zs.next_out = (Bytef *)out->data;
+	zs.avail_out = pipe->block_size;
+
+	while (true) {
+		if (zs.avail_out == 0) {
+			if (!reader_swap(pipe, out, pipe->block_size))
+				goto gzip_cleanup;
+			zs.next_out = (Bytef *)out->data;
+			zs.avail_out = pipe->block_size;
+		}
+		if (zs.avail_in == 0 && !eof) {
+			ssize_t bytes = read_some(pipe->fd, in, pipe->block_size);
+			if (bytes == -1)
+				goto gzip_cleanup;
+			eof = bytes == 0;
+			zs.next_in = (Bytef *)in;
+			zs.avail_in = bytes;
+		}
+
+		zret = inflate(&zs, Z_NO_FLUSH);
+		if (zret == Z_STREAM_END) {
+			if (zs.avail_in == 0 && !eof)
+				continue;
+			if (zs.avail_in == 0)
+				break;
+			/* Concatenated members, as produced by pigz or cat */
+			inflateReset(&zs);
+		} else if (zret == Z_BUF_ERROR) {
+			if (eof && zs.avail_in == 0 && zs.avail_out > 0) {
+				/* Truncated stream */
+				errno = EBADMSG;
+				goto gzip_cleanup;
+			}
+		} else if (zret != Z_OK) {
+			errno = zret == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+			goto gzip_cleanup;
+		}
+	}
+
+	ret = reader_swap(pipe, out, pipe->block_size - zs.avail_out);
+gzip_cleanup:
+	inflateEnd(&zs);
+	return ret;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static bool zstd_decompress(struct codec_reader *reader, char *in,
+		size_t in_len, struct chunk *out)
+{
+	struct pipeline *pipe = &reader->pipe;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer zin = { .src = in, .size = in_len, .pos = 0 };
+	ZSTD_outBuffer zout = { .dst = out->data, .size = pipe->block_size };
+	size_t zret = 0;
+	bool eof = false, ret = false;
+
+	if (dctx == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	while (true) {
+		if (zout.pos == zout.size) {
+			if (!reader_swap(pipe, out, zout.pos))
+				goto zstd_cleanup;
+			zout.dst = out->data;
+			zout.pos = 0;
+		}
+		if (zin.pos == zin.size && !eof) {
+			ssize_t bytes = read_some(pipe->fd, in, pipe->block_size);
+			if (bytes == -1)
+				goto zstd_cleanup;
+			eof = bytes == 0;
+			zin.size = bytes;
+			zin.pos = 0;
+		}
+
+		size_t prev_in = zin.pos, prev_out = zout.pos;
+		size_t hint = ZSTD_decompressStream(dctx, &zout, &zin);
+		if (ZSTD_isError(hint)) {
+			errno = EBADMSG;
+			goto zstd_cleanup;
+		}
+		if (zin.pos != prev_in || zout.pos != prev_out)
+			zret = hint;
+		else if (eof && zin.pos == zin.size)
+			break;
+	}
+	/* A non-zero hint from the last step means the frame was cut short */
+	if (zret != 0) {
+		errno = EBADMSG;
+		goto zstd_cleanup;
+	}
+
+	ret = reader_swap(pipe, out, zout.pos);
+zstd_cleanup:
+	ZSTD_freeDCtx(dctx);
+	return ret;
+}
+#endif
+
+static void *reader_thread(void *data)
+{
+	struct codec_reader *reader = data;
+	struct pipeline *pipe = &reader->pipe;
+	struct chunk out;
+	bool ret = false;
+
+	char *in = malloc(pipe->block_size);
+	if (in == NULL)
+		goto reader_thread_fail;
+	memcpy(in, reader->prefix, reader->prefix_len);
+	if (!queue_pop(pipe, &pipe->empty, &out))
+		goto reader_thread_fail;
+
+	switch (pipe->codec) {
+#ifdef HAVE_ZLIB
+		case CODEC_GZIP:
+			ret = gzip_decompress(reader, in, reader->prefix_len, &out);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			ret = zstd_decompress(reader, in, reader->prefix_len, &out);
+			break;
+#endif
+		default:
+			errno = ENOTSUP;
+			break;
+	}
+	if (!ret)
+		goto reader_thread_fail;
+
+	free(in);
+	queue_push(pipe, &pipe->full, (struct chunk) { .data = NULL, .len = 0 });
+	return NULL;
+
+reader_thread_fail:
+	pipeline_fail(pipe, errno);
+	free(in);
+	return NULL;
+}
+
+struct codec_reader *codec_reader_start(int fd, enum codec codec,
+		const void *prefix, size_t prefix_len, size_t block_size)
+{
+	struct codec_reader *reader = malloc(sizeof(struct codec_reader));
+	if (reader == NULL)
+		return NULL;
+	if (block_size < prefix_len)
+		block_size = prefix_len;
+	if (!pipeline_init(&reader->pipe, fd, codec, block_size))
+		goto reader_start_free;
+
+	reader->prefix = malloc(prefix_len);
+	if (reader->prefix == NULL && prefix_len > 0)
+		goto reader_start_destroy;
+	memcpy(reader->prefix, prefix, prefix_len);
+	reader->prefix_len = prefix_len;
+	reader->cur.data = NULL;
+	reader->cur.len = 0;
+	reader->cur_offset = 0;
+	reader->eof = false;
+
+	errno = pthread_create(&reader->pipe.thread, NULL, reader_thread, reader);
+	if (errno != 0)
+		goto reader_start_prefix;
+	return reader;
+
+reader_start_prefix:
+	free(reader->prefix);
+reader_start_destroy:
+	pipeline_destroy(&reader->pipe);
+reader_start_free:
+	free(reader);
+	return NULL;
+}
+
+/*
+ * Copies decompressed data into iov, only waiting on the decompression
+ * thread when nothing has been copied yet.
+ * @return The number of bytes copied, 0 on EOF and -1 on error
+ */
+ssize_t codec_reader_readv(struct codec_reader *reader,
+		const struct iovec *iov, int iovcnt)
+{
+	struct pipeline *pipe = &reader->pipe;
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt && !reader->eof; ++i) {
+		size_t iov_offset = 0;
+		while (iov_offset < iov[i].iov_len) {
+			if (reader->cur_offset == reader->cur.len) {
+				if (reader->cur.data != NULL)
+					queue_push(pipe, &pipe->empty, reader->cur);
+				reader->cur.data = NULL;
+				reader->cur.len = reader->cur_offset = 0;
+				if (total > 0)
+					return total;
+				if (!queue_pop(pipe, &pipe->full, &reader->cur))
+					return -1;
+				if (reader->cur.data == NULL) {
+					reader->eof = true;
+					return total;
+				}
+			}
+
+			size_t len = reader->cur.len - reader->cur_offset;
+			if (len > iov[i].iov_len - iov_offset)
+				len = iov[i].iov_len - iov_offset;
+			memcpy((char *)iov[i].iov_base + iov_offset,
+					reader->cur.data + reader->cur_offset, len);
+			reader->cur_offset += len;
+			iov_offset += len;
+			total += len;
+		}
+	}
+	return total;
+}
+
+void codec_reader_finish(struct codec_reader *reader)
+{
+	if (reader == NULL)
+		return;
+
+	/* Wakes the thread if the stream was abandoned before its end */
+	pipeline_fail(&reader->pipe, ECANCELED);
+	pthread_join(reader->pipe.thread, NULL);
+	pipeline_destroy(&reader->pipe);
+	free(reader->prefix);
+	free(reader);
+}
+
+/*
+ * Buffers compressed output and writes it out whenever it fills up.
+ */
+static bool writer_emit(struct pipeline *pipe, char *out, size_t *out_len,
+		bool force)
+{
+	if (*out_len < pipe->block_size && !force)
+		return true;
+	if (!write_all(pipe->fd, out, *out_len))
+		return false;
+	*out_len = 0;
+	return true;
+}
+
+#ifdef HAVE_ZLIB
+static bool gzip_compress(struct pipeline *pipe, char *out)
+{
+	z_stream zs = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	struct chunk chunk;
+	size_t out_len = 0;
+	bool ret = false;
+	int zret;
+
+	/* 16 selects a gzip header and trailer */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	while (queue_pop(pipe, &pipe->full, &chunk)) {
+		int flush = chunk.data == NULL ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = (Bytef *)chunk.data;
+		zs.avail_in = chunk.len;
+		do {
+			zs.next_out = (Bytef *)out + out_len;
+			zs.avail_out = pipe->block_size - out_len;
+			zret = deflate(&zs, flush);
+			if (zret == Z_STREAM_ERROR) {
+				errno = EINVAL;
+				goto gzip_cleanup;
+			}
+			out_len = pipe->block_size - zs.avail_out;
+			if (!writer_emit(pipe, out, &out_len, false))
+				goto gzip_cleanup;
+		} while (zs.avail_in > 0 || (flush == Z_FINISH && zret != Z_STREAM_END));
+
+		if (chunk.data == NULL) {
+			ret = writer_emit(pipe, out, &out_len, true);
+			break;
+		}
+		queue_push(pipe, &pipe->empty, chunk);
+	}
+gzip_cleanup:
+	deflateEnd(&zs);
+	return ret;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static bool zstd_compress(struct pipeline *pipe, char *out)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	struct chunk chunk;
+	size_t out_len = 0, remaining;
+	bool ret = false;
+
+	if (cctx == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	while (queue_pop(pipe, &pipe->full, &chunk)) {
+		ZSTD_EndDirective mode = chunk.data == NULL ?
+			ZSTD_e_end : ZSTD_e_continue;
+		ZSTD_inBuffer zin = { .src = chunk.data, .size = chunk.len };
+		do {
+			ZSTD_outBuffer zout = {
+				.dst = out, .size = pipe->block_size, .pos = out_len
+			};
+			remaining = ZSTD_compressStream2(cctx, &zout, &zin, mode);
+			if (ZSTD_isError(remaining)) {
+				errno = EINVAL;
+				goto zstd_cleanup;
+			}
+			out_len = zout.pos;
+			if (!writer_emit(pipe, out, &out_len, false))
+				goto zstd_cleanup;
+		} while (zin.pos < zin.size || (mode == ZSTD_e_end && remaining > 0));
+
+		if (chunk.data == NULL) {
+			ret = writer_emit(pipe, out, &out_len, true);
+			break;
+		}
+		queue_push(pipe, &pipe->empty, chunk);
+	}
+zstd_cleanup:
+	ZSTD_freeCCtx(cctx);
+	return ret;
+}
+#endif
+
+static void *writer_thread(void *data)
+{
+	struct codec_writer *writer = data;
+	struct pipeline *pipe = &writer->pipe;
+	bool ret = false;
+
+	char *out = malloc(pipe->block_size);
+	if (out == NULL)
+		goto writer_thread_fail;
+
+	switch (pipe->codec) {
+#ifdef HAVE_ZLIB
+		case CODEC_GZIP:
+			ret = gzip_compress(pipe, out);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			ret = zstd_compress(pipe, out);
+			break;
+#endif
+		default:
+			errno = ENOTSUP;
+			break;
+	}
+	if (!ret)
+		goto writer_thread_fail;
+
+	free(out);
+	return NULL;
+
+writer_thread_fail:
+	pipeline_fail(pipe, errno);
+	free(out);
+	return NULL;
+}
+
+struct codec_writer *codec_writer_start(int fd, enum codec codec,
+		size_t block_size)
+{
+	struct codec_writer *writer = malloc(sizeof(struct codec_writer));
+	if (writer == NULL)
+		return NULL;
+	if (!pipeline_init(&writer->pipe, fd, codec, block_size))
+		goto writer_start_free;
+
+	errno = pthread_create(&writer->pipe.thread, NULL, writer_thread, writer);
+	if (errno != 0)
+		goto writer_start_destroy;
+	return writer;
+
+writer_start_destroy:
+	pipeline_destroy(&writer->pipe);
+writer_start_free:
+	free(writer);
+	return NULL;
+}
+
+/*
+ * @return An empty block of the writer's block size, NULL on failure
+ */
+char *codec_writer_block(struct codec_writer *writer)
+{
+	struct chunk chunk;
+	if (!queue_pop(&writer->pipe, &writer->pipe.empty, &chunk))
+		return NULL;
+	return chunk.data;
+}
+
+bool codec_writer_submit(struct codec_writer *writer, char *block, size_t len)
+{
+	struct pipeline *pipe = &writer->pipe;
+	bool aborted;
+
+	pthread_mutex_lock(&pipe->lock);
+	aborted = pipe->aborted;
+	if (aborted)
+		errno = pipe->error;
+	pthread_mutex_unlock(&pipe->lock);
+	if (aborted)
+		return false;
+
+	if (len == 0)
+		queue_push(pipe, &pipe->empty, (struct chunk) { .data = block });
+	else
+		queue_push(pipe, &pipe->full,
+				(struct chunk) { .data = block, .len = len });
+	return true;
+}
+
+/*
+ * Flushes the compressed stream, or drops it if discard is set.
+ * @return false if any part of the stream failed to be written
+ */
+bool codec_writer_finish(struct codec_writer *writer, bool discard)
+{
+	struct pipeline *pipe = &writer->pipe;
+	bool ret;
+
+	if (discard)
+		pipeline_fail(pipe, ECANCELED);
+	else
+		queue_push(pipe, &pipe->full, (struct chunk) { .data = NULL });
+	pthread_join(pipe->thread, NULL);
+
+	ret = !pipe->aborted;
+	if (!ret)
+		errno = pipe->error;
+	pipeline_destroy(pipe);
+	free(writer);
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * codec.h: threaded compression and decompression pipelines
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define CODEC_MAGIC_LEN 4
+
+enum codec {
+	CODEC_NONE = 0,
+	CODEC_GZIP,
+	CODEC_ZSTD,
+};
+
+struct codec_reader;
+struct codec_writer;
+
+enum codec codec_detect(const unsigned char *magic, size_t len);
+bool codec_from_name(const char *name, enum codec *codec);
+bool codec_supported(enum codec codec);
+
+/*
+ * Decompresses fd on a separate thread, prefix holds bytes already read
+ * from the start of fd while detecting the format.
+ */
+struct codec_reader *codec_reader_start(int fd, enum codec codec,
+		const void *prefix, size_t prefix_len, size_t block_size);
+ssize_t codec_reader_readv(struct codec_reader *reader,
+		const struct iovec *iov, int iovcnt);
+void codec_reader_finish(struct codec_reader *reader);
+
+/*
+ * Compresses into fd on a separate thread. Blocks are taken from the writer
+ * with codec_writer_block() and handed back full with codec_writer_submit().
+ */
+struct codec_writer *codec_writer_start(int fd, enum codec codec,
+		size_t block_size);
+char *codec_writer_block(struct codec_writer *writer);
+bool codec_writer_submit(struct codec_writer *writer, char *block, size_t len);
+bool codec_writer_finish(struct codec_writer *writer, bool discard);
+
+#endif // CODEC_H
@@ -0,0 +1,500 @@
+/*
+ * dawg.c: minimized automaton for large substitution sets
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dawg.h"
+
+#define NO_NODE UINT32_MAX
+#define REGISTRY_MIN_SIZE 1024
+
+struct dawg {
+	/* Edges of node n run from first[n] to first[n+1], sorted by label */
+	uint32_t *first;
+	unsigned char *labels;
+	uint32_t *targets;
+	/* Keys below the lower labelled siblings, added to the rank */
+	uint32_t *skips;
+	uint32_t node_count, edge_count;
+	/* No key is a prefix of another, so all of them end in one leaf */
+	uint32_t final;
+	/* Indexed by the rank of the key in sorted order */
+	void **values;
+	size_t value_count, height;
+	const unsigned char *fold;
+};
+
+struct build_edge {
+	uint32_t target;
+	unsigned char label;
+};
+
+struct build_node {
+	struct build_edge *edges;
+	uint32_t edge_count, edge_size;
+	bool final;
+	/* Filled in while flattening */
+	uint32_t id, words;
+};
+
+/*
+ * Incremental construction from sorted keys as described by Daciuk et al.
+ * Only the path of the last key is ever left unminimized, every other node
+ * is interned in the registry as soon as no later key can extend it.
+ */
+struct builder {
+	struct build_node *nodes;
+	uint32_t node_count, node_size;
+	uint32_t *free_nodes;
+	size_t free_count, free_size;
+	/* Open addressed set of minimized nodes */
+	uint32_t *registry;
+	size_t registry_count, registry_size;
+	/* Nodes along the last key, path[0] being the root */
+	uint32_t *path;
+	unsigned char *prev;
+	size_t prev_len, height;
+	void **values;
+	size_t value_count, value_size;
+};
+
+static uint32_t new_node(struct builder *b)
+{
+	uint32_t id;
+	if (b->free_count > 0) {
+		id = b->free_nodes[--b->free_count];
+	} else {
+		if (b->node_count == b->node_size) {
+			if (b->node_size >= NO_NODE / 2) {
+				errno = EOVERFLOW;
+				return NO_NODE;
+			}
+			uint32_t size = b->node_size > 0 ? b->node_size << 1 : 1024;
+			struct build_node *resized = realloc(b->nodes,
+					size * sizeof(struct build_node));
+			if (resized == NULL)
+				return NO_NODE;
+			b->nodes = resized;
+			b->node_size = size;
+		}
+		id = b->node_count++;
+	}
+
+	memset(&b->nodes[id], 0, sizeof(struct build_node));
+	b->nodes[id].id = NO_NODE;
+	return id;
+}
+
+static bool free_node(struct builder *b, uint32_t id)
+{
+	free(b->nodes[id].edges);
+	b->nodes[id].edges = NULL;
+	if (b->free_count == b->free_size) {
+		size_t size = b->free_size > 0 ? b->free_size << 1 : 64;
+		uint32_t *resized = realloc(b->free_nodes, size * sizeof(uint32_t));
+		if (resized == NULL)
+			return false;
+		b->free_nodes = resized;
+		b->free_size = size;
+	}
+	b->free_nodes[b->free_count++] = id;
+	return true;
+}
+
+static bool add_edge(struct builder *b, uint32_t from, unsigned char label,
+		uint32_t to)
+{
+	struct build_node *node = &b->nodes[from];
+	if (node->edge_count == node->edge_size) {
+		uint32_t size = node->edge_size > 0 ? node->edge_size << 1 : 1;
+		struct build_edge *resized = realloc(node->edges,
+				size * sizeof(struct build_edge));
+		if (resized == NULL)
+			return false;
+		node->edges = resized;
+		node->edge_size = size;
+	}
+	node->edges[node->edge_count].label = label;
+	node->edges[node->edge_count].target = to;
+	++node->edge_count;
+	return true;
+}
+
+static size_t node_hash(const struct build_node *node)
+{
+	uint64_t hash = node->final ? 0x9e3779b97f4a7c15ULL : 0xcbf29ce484222325ULL;
+	for (uint32_t i = 0; i < node->edge_count; ++i) {
+		hash ^= node->edges[i].label | (uint64_t)node->edges[i].target << 8;
+		hash *= 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+static bool node_eq(const struct build_node *a, const struct build_node *b)
+{
+	if (a->final != b->final || a->edge_count != b->edge_count)
+		return false;
+	for (uint32_t i = 0; i < a->edge_count; ++i)
+		if (a->edges[i].label != b->edges[i].label ||
+				a->edges[i].target != b->edges[i].target)
+			return false;
+	return true;
+}
+
+static bool registry_grow(struct builder *b)
+{
+	size_t size = b->registry_size > 0 ?
+		b->registry_size << 1 : REGISTRY_MIN_SIZE;
+	uint32_t *registry = malloc(size * sizeof(uint32_t));
+	if (registry == NULL)
+		return false;
+	memset(registry, 0xff, size * sizeof(uint32_t));
+
+	for (size_t i = 0; i < b->registry_size; ++i) {
+		uint32_t id = b->registry[i];
+		if (id == NO_NODE)
+			continue;
+		size_t j = node_hash(&b->nodes[id]) & (size - 1);
+		while (registry[j] != NO_NODE)
+			j = (j + 1) & (size - 1);
+		registry[j] = id;
+	}
+	free(b->registry);
+	b->registry = registry;
+	b->registry_size = size;
+	return true;
+}
+
+/*
+ * Finds the registered node equivalent to id, registering id if there
+ * is none yet.
+ */
+static bool registry_intern(struct builder *b, uint32_t id, uint32_t *found)
+{
+	if ((b->registry_count + 1) * 2 > b->registry_size && !registry_grow(b))
+		return false;
+
+	size_t mask = b->registry_size - 1;
+	for (size_t i = node_hash(&b->nodes[id]) & mask;; i = (i + 1) & mask) {
+		uint32_t other = b->registry[i];
+		if (other == NO_NODE) {
+			b->registry[i] = id;
+			++b->registry_count;
+			*found = id;
+			return true;
+		}
+		if (node_eq(&b->nodes[other], &b->nodes[id])) {
+			*found = other;
+			return true;
+		}
+	}
+}
+
+/*
+ * Merges the nodes of the last key deeper than depth into the registry,
+ * no later key being able to add edges to them.
+ */
+static bool minimize(struct builder *b, size_t depth)
+{
+	for (size_t i = b->prev_len; i > depth; --i) {
+		uint32_t id = b->path[i], found;
+		if (!registry_intern(b, id, &found))
+			return false;
+		if (found == id)
+			continue;
+
+		struct build_node *parent = &b->nodes[b->path[i - 1]];
+		parent->edges[parent->edge_count - 1].target = found;
+		if (!free_node(b, id))
+			return false;
+	}
+	b->prev_len = depth;
+	return true;
+}
+
+static bool add_key(const wchar_t key[], size_t key_size, void *value,
+		void *data)
+{
+	struct builder *b = data;
+	size_t prefix = 0;
+
+	/* Input bytes can never match a wider character or an empty key */
+	if (key_size == 0)
+		return true;
+	for (size_t i = 0; i < key_size; ++i)
+		if (key[i] < 0 || key[i] > UCHAR_MAX)
+			return true;
+
+	if (key_size > b->height) {
+		uint32_t *path = realloc(b->path, (key_size + 1) * sizeof(uint32_t));
+		if (path == NULL)
+			return false;
+		b->path = path;
+		unsigned char *prev = realloc(b->prev, key_size);
+		if (prev == NULL)
+			return false;
+		b->prev = prev;
+		b->height = key_size;
+	}
+	if (b->value_count == b->value_size) {
+		size_t size = b->value_size > 0 ? b->value_size << 1 : 64;
+		void **values = realloc(b->values, size * sizeof(void *));
+		if (values == NULL)
+			return false;
+		b->values = values;
+		b->value_size = size;
+	}
+
+	while (prefix < b->prev_len && prefix < key_size &&
+			b->prev[prefix] == key[prefix])
+		++prefix;
+	if (!minimize(b, prefix))
+		return false;
+
+	for (size_t i = prefix; i < key_size; ++i) {
+		uint32_t id = new_node(b);
+		if (id == NO_NODE || !add_edge(b, b->path[i], key[i], id))
+			return false;
+		b->path[i + 1] = id;
+		b->prev[i] = key[i];
+	}
+	b->nodes[b->path[key_size]].final = true;
+	b->prev_len = key_size;
+	b->values[b->value_count++] = value;
+	return true;
+}
+
+/*
+ * Gives every reachable node its final id in depth first order and counts
+ * the keys below it.
+ */
+static bool number_nodes(struct builder *b, uint32_t id, uint32_t *order,
+		uint32_t *next_id, uint64_t *edge_count)
+{
+	struct build_node *node = &b->nodes[id];
+	uint64_t words = node->final;
+	if (node->id != NO_NODE)
+		return true;
+
+	node->id = (*next_id)++;
+	order[node->id] = id;
+	*edge_count += node->edge_count;
+	for (uint32_t i = 0; i < node->edge_count; ++i) {
+		uint32_t target = b->nodes[id].edges[i].target;
+		if (!number_nodes(b, target, order, next_id, edge_count))
+			return false;
+		words += b->nodes[target].words;
+	}
+	if (words > UINT32_MAX || *edge_count > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return false;
+	}
+	b->nodes[id].words = words;
+	return true;
+}
+
+static struct dawg *flatten(struct builder *b, pfx_tree_t tree)
+{
+	uint32_t *order = malloc(b->node_count * sizeof(uint32_t));
+	uint32_t node_count = 0;
+	uint64_t edge_count = 0;
+	struct dawg *dawg;
+	if (order == NULL)
+		return NULL;
+	if (!number_nodes(b, b->path[0], order, &node_count, &edge_count))
+		goto flatten_fail;
+
+	dawg = calloc(1, sizeof(struct dawg));
+	if (dawg == NULL)
+		goto flatten_fail;
+	dawg->node_count = node_count;
+	dawg->edge_count = edge_count;
+	dawg->final = NO_NODE;
+	dawg->height = b->height;
+	dawg->fold = pfx_tree_fold_table(tree);
+	dawg->first = malloc((node_count + 1) * sizeof(uint32_t));
+	dawg->labels = malloc(edge_count + 1);
+	dawg->targets = malloc((edge_count + 1) * sizeof(uint32_t));
+	dawg->skips = malloc((edge_count + 1) * sizeof(uint32_t));
+	if (dawg->first == NULL || dawg->labels == NULL ||
+			dawg->targets == NULL || dawg->skips == NULL) {
+		dawg_destroy(dawg);
+		goto flatten_fail;
+	}
+
+	uint32_t edge = 0;
+	for (uint32_t id = 0; id < node_count; ++id) {
+		const struct build_node *node = &b->nodes[order[id]];
+		uint32_t skip = 0;
+		dawg->first[id] = edge;
+		if (node->final)
+			dawg->final = id;
+		for (uint32_t i = 0; i < node->edge_count; ++i, ++edge) {
+			const struct build_node *target = &b->nodes[node->edges[i].target];
+			dawg->labels[edge] = node->edges[i].label;
+			dawg->targets[edge] = target->id;
+			dawg->skips[edge] = skip;
+			skip += target->words;
+		}
+	}
+	dawg->first[node_count] = edge;
+
+	/* The builder's values are already in rank order */
+	dawg->values = b->values;
+	dawg->value_count = b->value_count;
+	b->values = NULL;
+	free(order);
+	return dawg;
+
+flatten_fail:
+	free(order);
+	return NULL;
+}
+
+static void builder_destroy(struct builder *b)
+{
+	for (uint32_t i = 0; i < b->node_count; ++i)
+		free(b->nodes[i].edges);
+	free(b->nodes);
+	free(b->free_nodes);
+	free(b->registry);
+	free(b->path);
+	free(b->prev);
+	free(b->values);
+}
+
+/*
+ * Builds the automaton from the keys of tree, which may be destroyed
+ * afterwards although the values are shared with it.
+ */
+struct dawg *dawg_build(pfx_tree_t tree)
+{
+	struct builder b;
+	struct dawg *dawg = NULL;
+	uint32_t root;
+
+	memset(&b, 0, sizeof(b));
+	b.path = malloc(sizeof(uint32_t));
+	if (b.path == NULL)
+		return NULL;
+	root = new_node(&b);
+	if (root == NO_NODE)
+		goto dawg_build_cleanup;
+	b.path[0] = root;
+
+	/* The walk hands over keys in sorted order, as construction needs */
+	if (!pfx_tree_walk(tree, add_key, &b) || !minimize(&b, 0))
+		goto dawg_build_cleanup;
+	dawg = flatten(&b, tree);
+
+dawg_build_cleanup:
+	builder_destroy(&b);
+	return dawg;
+}
+
+void dawg_destroy(struct dawg *dawg)
+{
+	if (dawg == NULL)
+		return;
+	free(dawg->first);
+	free(dawg->labels);
+	free(dawg->targets);
+	free(dawg->skips);
+	free(dawg->values);
+	free(dawg);
+}
+
+size_t dawg_height(const struct dawg *dawg)
+{
+	return dawg->height;
+}
+
+const unsigned char *dawg_fold_table(const struct dawg *dawg)
+{
+	return dawg->fold;
+}
+
+/*
+ * Counts the nodes and edges of the automaton and the heap bytes they
+ * and the value table occupy.
+ */
+void dawg_stats(const struct dawg *dawg, size_t *nodes, size_t *edges,
+		size_t *bytes)
+{
+	*nodes = dawg->node_count;
+	*edges = dawg->edge_count;
+	*bytes = sizeof(struct dawg) +
+		(dawg->node_count + 1) * sizeof(uint32_t) +
+		dawg->edge_count * (1 + 2 * sizeof(uint32_t)) +
+		dawg->value_count * sizeof(void *);
+}
+
+void dawg_iter_init(const struct dawg *dawg, struct dawg_iter *iter)
+{
+	iter->node = 0;
+	iter->rank = 0;
+}
+
+bool dawg_iter_next(const struct dawg *dawg, struct dawg_iter *iter,
+		unsigned char c)
+{
+	uint32_t left = dawg->first[iter->node];
+	uint32_t right = dawg->first[iter->node + 1], end = right;
+	while (left < right) {
+		uint32_t mid = left + ((right - left) >> 1);
+		if (dawg->labels[mid] < c)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	if (left == end || dawg->labels[left] != c)
+		return false;
+
+	iter->rank += dawg->skips[left];
+	iter->node = dawg->targets[left];
+	return true;
+}
+
+/*
+ * Starts loading the edge range the next dawg_iter_next() on iter reads.
+ */
+void dawg_iter_prefetch(const struct dawg *dawg,
+		const struct dawg_iter *iter)
+{
+	__builtin_prefetch(&dawg->first[iter->node]);
+}
+
+/*
+ * @return The value of the key ending at iter, or NULL if none does
+ */
+void *dawg_iter_data(const struct dawg *dawg, const struct dawg_iter *iter)
+{
+	if (iter->node != dawg->final)
+		return NULL;
+	return dawg->values[iter->rank];
+}
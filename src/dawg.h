@@ -0,0 +1,61 @@
+/*
+ * dawg.h: minimized automaton for large substitution sets
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef DAWG_H
+#define DAWG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "pfx_tree.h"
+
+/*
+ * A read only, minimized directed acyclic word graph holding the same keys
+ * as a pfx_tree. Common suffixes are shared as well as prefixes, so rule
+ * sets with millions of similar keys stay small enough to match from cache.
+ * Values are found by the rank of their key, summed along the path.
+ */
+struct dawg;
+
+struct dawg_iter {
+	uint32_t node;
+	uint32_t rank;
+};
+
+struct dawg *dawg_build(pfx_tree_t tree);
+void dawg_destroy(struct dawg *dawg);
+size_t dawg_height(const struct dawg *dawg);
+const unsigned char *dawg_fold_table(const struct dawg *dawg);
+void dawg_stats(const struct dawg *dawg, size_t *nodes, size_t *edges,
+		size_t *bytes);
+
+void dawg_iter_init(const struct dawg *dawg, struct dawg_iter *iter);
+bool dawg_iter_next(const struct dawg *dawg, struct dawg_iter *iter,
+		unsigned char c);
+void *dawg_iter_data(const struct dawg *dawg, const struct dawg_iter *iter);
+void dawg_iter_prefetch(const struct dawg *dawg,
+		const struct dawg_iter *iter);
+
+#endif // DAWG_H
@@ -20,30 +20,152 @@
  * THE SOFTWARE.
  */
 
+#include <signal.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
 
+#include "cache.h"
+#include "dawg.h"
 #include "pfx_tree.h"
+#include "server.h"
 #include "util.h"
 
-static const char opts[] = "hr:";
+#define DEFAULT_CACHE_SIZE ((size_t)1 << 30)
+
+static const char opts[] = "b:c:C:dDf:hHiI:l::m:M:pr:s:Stu:w:z::";
 static const struct option long_opts[] = {
+	{
+		.name = "block-size",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'b'
+	},
+	{
+		.name = "cache",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'c'
+	},
+	{
+		.name = "cache-size",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'C'
+	},
+	{
+		.name = "cache-stats",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'S'
+	},
+	{
+		.name = "compress",
+		.has_arg = optional_argument,
+		.flag = NULL,
+		.val = 'z'
+	},
+	{
+		.name = "connect",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'u'
+	},
+	{
+		.name = "dawg",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'd'
+	},
+	{
+		.name = "decompress",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'D'
+	},
+	{
+		.name = "rules-file",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'f'
+	},
 	{
 		.name = "help",
 		.has_arg = no_argument,
 		.flag = NULL,
 		.val = 'h'
 	},
+	{
+		.name = "huge-pages",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'H'
+	},
+	{
+		.name = "ignore-case",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'i'
+	},
+	{
+		.name = "interleave",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'I'
+	},
+	{
+		.name = "in-place",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'p'
+	},
+	{
+		.name = "list-matches",
+		.has_arg = optional_argument,
+		.flag = NULL,
+		.val = 'l'
+	},
+	{
+		.name = "max-replacements",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'm'
+	},
+	{
+		.name = "max-rule-replacements",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'M'
+	},
+	{
+		.name = "matcher-stats",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 't'
+	},
 	{
 		.name = "replace",
 		.has_arg = required_argument,
 		.flag = NULL,
 		.val = 'r'
 	},
+	{
+		.name = "serve",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 's'
+	},
+	{
+		.name = "workers",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'w'
+	},
 	NULL
 };
 
@@ -60,17 +182,262 @@ static bool get_two_subopts(int argc, char *argv[], char **opt1, char **opt2)
 	return true;
 }
 
-int main(int argc, char *argv[])
+struct replace_arg {
+	char *needle, *replacement;
+	size_t max_replacements;
+};
+
+struct rule_list {
+	struct replace_arg *args;
+	size_t count, size;
+	/* Contents of the rule files, which args point into */
+	char **files;
+	size_t file_count;
+};
+
+static bool add_rule(struct rule_list *rules, char *needle, char *replacement)
 {
-	int opt_ret, main_ret = EXIT_FAILURE;
-	pfx_tree_t substitutions;
-	size_t longest_replacement = 0;
+	if (rules->count == rules->size) {
+		size_t size = rules->size > 0 ? rules->size << 1 : 16;
+		struct replace_arg *resized = realloc(rules->args,
+				size * sizeof(struct replace_arg));
+		if (resized == NULL)
+			return false;
+		rules->args = resized;
+		rules->size = size;
+	}
+	rules->args[rules->count].needle = needle;
+	rules->args[rules->count].replacement = replacement;
+	rules->args[rules->count].max_replacements = 0;
+	++rules->count;
+	return true;
+}
+
+/*
+ * Reads one NEEDLE<TAB>REPLACEMENT rule per line, for rule sets too large
+ * to pass on the command line. Blank lines are skipped.
+ */
+static bool load_rules(struct rule_list *rules, const char *fn)
+{
+	size_t size = 0, len = 0, line = 0;
+	char *buf = NULL, **files;
+	FILE *file = fopen(fn, "r");
+	if (file == NULL) {
+		perror("Error opening the rules file");
+		return false;
+	}
+
+	/* Lines are split in place, so the buffer lives as long as the rules */
+	while (!feof(file)) {
+		if (len + 1 >= size) {
+			char *resized = realloc(buf, size = size > 0 ? size << 1 : 4096);
+			if (resized == NULL)
+				goto load_rules_fail;
+			buf = resized;
+		}
+		len += fread(buf + len, 1, size - len - 1, file);
+		if (ferror(file))
+			goto load_rules_fail;
+	}
+	buf[len] = '\0';
+	files = realloc(rules->files, (rules->file_count + 1) * sizeof(char *));
+	if (files == NULL)
+		goto load_rules_fail;
+	rules->files = files;
+	rules->files[rules->file_count++] = buf;
+	fclose(file);
 
-	substitutions = pfx_tree_init();
+	for (char *next, *cur = buf; cur < buf + len; cur = next) {
+		char *tab, *end = strchr(cur, '\n');
+		next = end != NULL ? end + 1 : buf + len;
+		if (end != NULL)
+			*end = '\0';
+		++line;
+		if (*cur == '\0')
+			continue;
+		tab = strchr(cur, '\t');
+		if (tab == NULL) {
+			fprintf(stderr, "%s:%zu: Expected NEEDLE<TAB>REPLACEMENT\n",
+					fn, line);
+			return false;
+		}
+		*tab = '\0';
+		if (!add_rule(rules, cur, tab + 1)) {
+			perror("Error loading rules");
+			return false;
+		}
+	}
+	return true;
+
+load_rules_fail:
+	perror("Error reading the rules file");
+	free(buf);
+	fclose(file);
+	return false;
+}
+
+static void print_matcher_stats(pfx_tree_t tree, const struct dawg *dawg)
+{
+	size_t nodes = 0, edges, bytes = 0;
+	pfx_tree_stats(tree, &nodes, &bytes);
+	fprintf(stderr, "Tree: %zu nodes using %zu bytes\n", nodes, bytes);
+	if (dawg != NULL) {
+		dawg_stats(dawg, &nodes, &edges, &bytes);
+		fprintf(stderr, "DAWG: %zu nodes, %zu edges using %zu bytes\n",
+				nodes, edges, bytes);
+	}
+}
+
+/*
+ * Compiles the replacements once all options are known, as flags like
+ * case folding change how every key is stored. The tree values point
+ * into subs, which must hold count entries. What substitutions need to
+ * know about the whole set is noted here rather than walked for per file.
+ */
+static pfx_tree_t build_substitutions(const struct replace_arg *args,
+		size_t count, unsigned flags, struct substitution *subs,
+		size_t *longest_replacement, bool *same_length)
+{
+	pfx_tree_t substitutions = pfx_tree_init_flags(flags);
 	if (substitutions == NULL) {
 		fprintf(stderr, "Failed to allocate the substitution tree\n");
-		goto main_cleanup;
+		return NULL;
+	}
+
+	*longest_replacement = 0;
+	*same_length = true;
+	for (size_t i = 0; i < count; ++i) {
+		wchar_t *key_str = from_utf8(args[i].needle);
+		if (key_str == NULL) {
+			perror("Error parsing arguments");
+			goto build_fail;
+		}
+		subs[i].replacement = args[i].replacement;
+		subs[i].replacement_len = strlen(args[i].replacement);
+		subs[i].id = i;
+		subs[i].max_replacements = args[i].max_replacements;
+		if (!pfx_tree_insert_safe(substitutions,
+				key_str, wcslen(key_str), &subs[i])) {
+			fprintf(stderr, "Failed to insert replacement, "
+					"it probably shares a key with another.\n");
+			free(key_str);
+			goto build_fail;
+		}
+		if (subs[i].replacement_len != wcslen(key_str))
+			*same_length = false;
+		free(key_str);
+
+		if (subs[i].replacement_len > *longest_replacement)
+			*longest_replacement = subs[i].replacement_len;
 	}
+	return substitutions;
+
+build_fail:
+	pfx_tree_destroy(substitutions);
+	return NULL;
+}
+
+/*
+ * When every rule has its own limit the file is done once all of them
+ * are used up, so the global limit can be tightened to their sum.
+ */
+static size_t total_limit(const struct replace_arg *args, size_t count,
+		size_t max_replacements)
+{
+	size_t sum = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (args[i].max_replacements == 0 ||
+				sum + args[i].max_replacements < sum)
+			return max_replacements;
+		sum += args[i].max_replacements;
+	}
+	if (count == 0 || (max_replacements > 0 && max_replacements < sum))
+		return max_replacements;
+	return sum;
+}
+
+/*
+ * Serves until interrupted. The signals are blocked before the workers
+ * start so they all inherit the mask and only sigwait() sees them.
+ */
+static bool serve(const char *socket_fn, size_t workers,
+		pfx_tree_t substitutions, size_t longest_replacement,
+		const struct substitute_opts *opts)
+{
+	struct server *server;
+	sigset_t signals;
+	int sig;
+
+	if (workers == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+	/* A client closing its output pipe must not take the server down */
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	server = server_start(socket_fn, workers, substitutions,
+			longest_replacement, opts);
+	if (server == NULL) {
+		perror("Error starting the server");
+		return false;
+	}
+	sigwait(&signals, &sig);
+	server_stop(server);
+	return true;
+}
+
+/*
+ * Like perror, explaining input that only looked compressed.
+ */
+static void print_error(const char *what)
+{
+	if (errno == EBADMSG)
+		fprintf(stderr, "%s: The input does not decompress, "
+				"leave out --decompress to substitute it as is\n", what);
+	else
+		perror(what);
+}
+
+/*
+ * A file of - is passed to the server as the matching standard stream.
+ */
+static struct server_file client_file(const char *fn, int std_fd)
+{
+	return (struct server_file) {
+		.fn = fn,
+		.fd = strcmp(fn, "-") == 0 ? std_fd : -1,
+	};
+}
+
+int main(int argc, char *argv[])
+{
+	int opt_ret, main_ret = EXIT_FAILURE;
+	pfx_tree_t substitutions = NULL;
+	struct dawg *dawg = NULL;
+	struct rule_list rules = { .args = NULL, .files = NULL };
+	struct substitution *subs = NULL;
+	size_t longest_replacement;
+	unsigned tree_flags = 0;
+	bool in_place = false, cache_stats = false;
+	bool use_dawg = false, matcher_stats = false, list = false;
+	enum list_format list_format = LIST_TEXT;
+	const char *cache_dir = NULL, *serve_socket = NULL, *connect_socket = NULL;
+	size_t cache_size = DEFAULT_CACHE_SIZE, workers = 0;
+	struct substitute_opts sub_opts = {
+		.block_size = DEFAULT_BLOCK_SIZE,
+		.huge_pages = false,
+		.decompress = false,
+		.compress = CODEC_NONE,
+		.cache = NULL,
+		.max_replacements = 0,
+		.dawg = NULL,
+		.lanes = 1,
+	};
 
 	while ((opt_ret = getopt_long(argc, argv, opts, long_opts, NULL)) != -1) {
 		char *opt1, *opt2;
@@ -79,23 +446,112 @@ int main(int argc, char *argv[])
 				if (!get_two_subopts(argc, argv, &opt1, &opt2))
 					goto main_print_help;
 
-				wchar_t *key_str = from_utf8(opt1);
-				if (key_str == NULL) {
+				if (!add_rule(&rules, opt1, opt2)) {
 					perror("Error parsing arguments");
 					goto main_cleanup;
 				}
-				if (!pfx_tree_insert_safe(substitutions,
-						key_str, wcslen(key_str), opt2)) {
-					fprintf(stderr, "Failed to insert replacement, "
-							"it probably shares a key with another.\n");
-					free(key_str);
+				break;
+			case 'f':
+				if (!load_rules(&rules, optarg))
+					goto main_cleanup;
+				break;
+			case 'd':
+				use_dawg = true;
+				break;
+			case 'D':
+				sub_opts.decompress = true;
+				break;
+			case 't':
+				matcher_stats = true;
+				break;
+			case 'i':
+				tree_flags |= PFX_TREE_ICASE;
+				break;
+			case 'I':
+				if (!parse_size(optarg, &sub_opts.lanes) ||
+						sub_opts.lanes == 0) {
+					fprintf(stderr, "Invalid cursor count: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'l':
+				list = true;
+				if (optarg == NULL || strcmp(optarg, "text") == 0) {
+					list_format = LIST_TEXT;
+				} else if (strcmp(optarg, "binary") == 0) {
+					list_format = LIST_BINARY;
+				} else {
+					fprintf(stderr, "Unknown listing format: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'm':
+				if (!parse_size(optarg, &sub_opts.max_replacements)) {
+					fprintf(stderr, "Invalid replacement limit: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'M':
+				if (rules.count == 0) {
+					fprintf(stderr, "A rule limit must follow "
+							"the --replace it applies to\n");
+					goto main_print_help;
+				}
+				if (!parse_size(optarg,
+						&rules.args[rules.count-1].max_replacements)) {
+					fprintf(stderr, "Invalid replacement limit: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'p':
+				in_place = true;
+				break;
+			case 'b':
+				if (!parse_size(optarg, &sub_opts.block_size)) {
+					fprintf(stderr, "Invalid block size: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'c':
+				cache_dir = optarg;
+				break;
+			case 'C':
+				if (!parse_size(optarg, &cache_size)) {
+					fprintf(stderr, "Invalid cache size: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'S':
+				cache_stats = true;
+				break;
+			case 's':
+				serve_socket = optarg;
+				break;
+			case 'u':
+				connect_socket = optarg;
+				break;
+			case 'w':
+				if (!parse_size(optarg, &workers) || workers == 0) {
+					fprintf(stderr, "Invalid worker count: %s\n", optarg);
+					goto main_print_help;
+				}
+				break;
+			case 'H':
+				sub_opts.huge_pages = true;
+				break;
+			case 'z':
+				sub_opts.compress = CODEC_GZIP;
+				if (optarg != NULL &&
+						!codec_from_name(optarg, &sub_opts.compress)) {
+					fprintf(stderr, "Unknown compression format: %s\n", optarg);
+					goto main_print_help;
+				}
+				if (!codec_supported(sub_opts.compress)) {
+					fprintf(stderr, "Compression format not supported "
+							"by this build: %s\n",
+							optarg != NULL ? optarg : "gzip");
 					goto main_cleanup;
 				}
-				free(key_str);
-
-				size_t tmp_replacement = strlen(opt2);
-				if (tmp_replacement > longest_replacement)
-					longest_replacement = tmp_replacement;
 				break;
 			case 'h':
 			default:
@@ -105,14 +561,117 @@ int main(int argc, char *argv[])
 	argv += optind;
 	argc -= optind;
 
-	if (argc != 2) {
+	if (serve_socket != NULL && connect_socket != NULL) {
+		fprintf(stderr, "Serving and connecting are exclusive\n");
+		goto main_print_help;
+	}
+	if (list) {
+		if (in_place || serve_socket != NULL || connect_socket != NULL ||
+				sub_opts.compress != CODEC_NONE || cache_dir != NULL) {
+			fprintf(stderr, "Listing matches only reads SRC, "
+					"it takes no output options\n");
+			goto main_print_help;
+		}
+		if (argc != 1) {
+			fprintf(stderr, "You must pass a single SRC to list\n");
+			goto main_print_help;
+		}
+	} else if (serve_socket != NULL) {
+		if (argc != 0) {
+			fprintf(stderr, "The server takes its files from clients\n");
+			goto main_print_help;
+		}
+	} else if (in_place) {
+		if (argc != 1) {
+			fprintf(stderr, "You must pass a single FILE to patch\n");
+			goto main_print_help;
+		}
+		for (size_t i = 0; i < rules.count; ++i)
+			if (strlen(rules.args[i].needle) !=
+					strlen(rules.args[i].replacement)) {
+				fprintf(stderr, "Patching in place requires every "
+						"REPLACEMENT to be as long as its NEEDLE\n");
+				goto main_cleanup;
+			}
+	} else if (argc != 2) {
 		fprintf(stderr, "You must pass a SRC and DEST file\n");
 		goto main_print_help;
 	}
 
-	if (!substitute_file(argv[1], argv[0], substitutions,
-				longest_replacement)) {
-		perror("Error substituting");
+	if (connect_socket != NULL) {
+		struct server_file src = client_file(argv[0], STDIN_FILENO);
+		struct server_file dest = in_place ? src :
+			client_file(argv[1], STDOUT_FILENO);
+		if (rules.count > 0) {
+			fprintf(stderr, "Rules are loaded by the server, "
+					"not by its clients\n");
+			goto main_print_help;
+		}
+		if (!server_submit(connect_socket, &src, &dest, in_place)) {
+			print_error(in_place ? "Error patching" : "Error substituting");
+			goto main_cleanup;
+		}
+		main_ret = EXIT_SUCCESS;
+		goto main_cleanup;
+	}
+
+	subs = calloc(rules.count > 0 ? rules.count : 1,
+			sizeof(struct substitution));
+	if (subs == NULL) {
+		perror("Error parsing arguments");
+		goto main_cleanup;
+	}
+	substitutions = build_substitutions(rules.args, rules.count,
+			tree_flags, subs, &longest_replacement,
+			&sub_opts.same_length);
+	if (substitutions == NULL)
+		goto main_cleanup;
+	sub_opts.max_replacements = total_limit(rules.args, rules.count,
+			sub_opts.max_replacements);
+
+	if (use_dawg) {
+		dawg = dawg_build(substitutions);
+		if (dawg == NULL) {
+			perror("Error building the DAWG");
+			goto main_cleanup;
+		}
+		sub_opts.dawg = dawg;
+	}
+	if (matcher_stats)
+		print_matcher_stats(substitutions, dawg);
+
+	if (cache_dir != NULL && (!in_place || serve_socket != NULL)) {
+		sub_opts.cache = cache_open(cache_dir, cache_size,
+				substitutions, &sub_opts);
+		if (sub_opts.cache == NULL) {
+			perror("Error opening the cache");
+			goto main_cleanup;
+		}
+	}
+
+	if (list) {
+		if (!list_matches(STDOUT_FILENO, argv[0], substitutions,
+					list_format, &sub_opts)) {
+			print_error("Error listing matches");
+			goto main_cleanup;
+		}
+	} else if (serve_socket != NULL) {
+		if (!serve(serve_socket, workers, substitutions,
+					longest_replacement, &sub_opts))
+			goto main_cleanup;
+	} else if (in_place) {
+		if (!substitute_in_place(argv[0], substitutions, &sub_opts)) {
+			perror("Error patching");
+			goto main_cleanup;
+		}
+	} else if (!substitute_file(argv[1], argv[0], substitutions,
+				longest_replacement, &sub_opts)) {
+		print_error("Error substituting");
+		goto main_cleanup;
+	}
+	if (cache_stats && sub_opts.cache != NULL &&
+			!cache_print_stats(sub_opts.cache, stderr)) {
+		perror("Error reading cache statistics");
 		goto main_cleanup;
 	}
 
@@ -121,14 +680,63 @@ int main(int argc, char *argv[])
 
 main_print_help:
 	fprintf(stderr, "Usage: substitute [OPTION] SRC DEST\n");
+	fprintf(stderr, "   or: substitute --in-place [OPTION] FILE\n");
+	fprintf(stderr, "   or: substitute --list-matches[=FORMAT] [OPTION] SRC\n");
+	fprintf(stderr, "   or: substitute --serve=SOCKET [OPTION]\n");
+	fprintf(stderr, "   or: substitute --connect=SOCKET [--in-place] SRC [DEST]\n");
 	fprintf(stderr, "Example: substitute -r foo bar in.txt out.txt\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -b, --block-size=SIZE               "
+			"Reads and writes in blocks of SIZE bytes (K, M, G suffixes)\n");
+	fprintf(stderr, "  -c, --cache=DIR                     "
+			"Reuses earlier results for identical inputs stored in DIR\n");
+	fprintf(stderr, "  -C, --cache-size=SIZE               "
+			"Evicts the least recently used results beyond SIZE (1G)\n");
+	fprintf(stderr, "  -d, --dawg                          "
+			"Matches with a minimized automaton, smaller for large rule sets\n");
+	fprintf(stderr, "  -D, --decompress                    "
+			"Decompresses gzip or zstd input before matching\n");
+	fprintf(stderr, "  -f, --rules-file=FILE               "
+			"Reads a NEEDLE<TAB>REPLACEMENT rule from each line of FILE\n");
 	fprintf(stderr, "  -h, --help                          "
 			"Displays this help text\n");
+	fprintf(stderr, "  -H, --huge-pages                    "
+			"Backs the I/O buffers with huge pages when available\n");
+	fprintf(stderr, "  -i, --ignore-case                   "
+			"Matches every NEEDLE regardless of ASCII case\n");
+	fprintf(stderr, "  -I, --interleave=N                  "
+			"Walks N cursors over the input in lockstep to overlap cache misses\n");
+	fprintf(stderr, "  -l, --list-matches[=FORMAT]         "
+			"Prints OFFSET, RULE and LENGTH of each match as text or binary\n");
+	fprintf(stderr, "  -m, --max-replacements=N            "
+			"Copies the rest of the file unchanged after N replacements\n");
+	fprintf(stderr, "  -M, --max-rule-replacements=N       "
+			"Applies the preceding --replace at most N times per file\n");
+	fprintf(stderr, "  -p, --in-place                      "
+			"Patches FILE where every REPLACEMENT is as long as its NEEDLE\n");
 	fprintf(stderr, "  -r, --replace=NEEDLE REPLACEMENT    "
 			"Replaces the NEEDLE in the source text with REPLACEMENT\n");
+	fprintf(stderr, "  -s, --serve=SOCKET                  "
+			"Loads the rules once and serves clients on SOCKET until stopped\n");
+	fprintf(stderr, "  -S, --cache-stats                   "
+			"Prints the cache hit rate and size after substituting\n");
+	fprintf(stderr, "  -t, --matcher-stats                 "
+			"Prints the size of the tree and automaton used for matching\n");
+	fprintf(stderr, "  -u, --connect=SOCKET                "
+			"Has the server on SOCKET do the work, - passes stdin or stdout\n");
+	fprintf(stderr, "  -w, --workers=N                     "
+			"Serves N clients at once (one per CPU)\n");
+	fprintf(stderr, "  -z, --compress[=FORMAT]             "
+			"Compresses the output as gzip (default) or zstd\n");
 main_cleanup:
+	cache_close(sub_opts.cache);
+	dawg_destroy(dawg);
 	pfx_tree_destroy(substitutions);
+	free(subs);
+	free(rules.args);
+	for (size_t i = 0; i < rules.file_count; ++i)
+		free(rules.files[i]);
+	free(rules.files);
 	return main_ret;
 }
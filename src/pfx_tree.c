@@ -32,9 +32,46 @@ struct pfx_tree_node {
 	struct pfx_tree_node **children;
 	size_t children_count, children_size;
 	wchar_t c;
+	/* Only meaningful on the root node */
+	unsigned char flags;
 	void *data;
 };
 
+/*
+ * The root keeps the length of its longest key and whether any key holds
+ * a NUL, which every substitution needs and which would otherwise take a
+ * walk of the whole tree.
+ */
+struct pfx_tree_root {
+	struct pfx_tree_node node;
+	size_t height;
+	bool has_nul;
+};
+
+/*
+ * Input bytes are folded through one of these before each step, so a case
+ * insensitive tree stores only the lowercase spelling of each key.
+ */
+#define FOLD_ID(i) (i)
+#define FOLD_LOWER(i) ((i) >= 'A' && (i) <= 'Z' ? (i) - 'A' + 'a' : (i))
+#define FOLD_4(f, i) f(i), f(i+1), f(i+2), f(i+3)
+#define FOLD_16(f, i) FOLD_4(f, i), FOLD_4(f, i+4), FOLD_4(f, i+8), \
+	FOLD_4(f, i+12)
+#define FOLD_64(f, i) FOLD_16(f, i), FOLD_16(f, i+16), FOLD_16(f, i+32), \
+	FOLD_16(f, i+48)
+#define FOLD_256(f) FOLD_64(f, 0), FOLD_64(f, 64), FOLD_64(f, 128), \
+	FOLD_64(f, 192)
+
+static const unsigned char identity_table[256] = { FOLD_256(FOLD_ID) };
+static const unsigned char lower_table[256] = { FOLD_256(FOLD_LOWER) };
+
+static wchar_t fold_key(const struct pfx_tree_node *root, wchar_t c)
+{
+	if ((root->flags & PFX_TREE_ICASE) && c >= L'A' && c <= L'Z')
+		return c - L'A' + L'a';
+	return c;
+}
+
 /*
  * @return The index of the key if it exists,
  * 	otherwise the index to the right of the missing key
@@ -61,20 +98,37 @@ static size_t find_child_idx(struct pfx_tree_node *node, wchar_t key,
 
 pfx_tree_t pfx_tree_init()
 {
-	pfx_tree_t tree = malloc(sizeof(struct pfx_tree_node));
-	if (tree == NULL)
+	return pfx_tree_init_flags(0);
+}
+
+static struct pfx_tree_node *node_init(size_t size, unsigned flags)
+{
+	struct pfx_tree_node *node = malloc(size);
+	if (node == NULL)
 		return NULL;
 
-	tree->data = NULL;
-	tree->children_count = 0;
-	tree->children_size = 7;
+	node->flags = flags;
+	node->data = NULL;
+	node->children_count = 0;
+	node->children_size = 7;
 
-	tree->children = malloc(sizeof(struct pfx_tree_node *)*tree->children_size);
-	if (tree->children == NULL) {
-		free(tree);
+	node->children = malloc(sizeof(struct pfx_tree_node *)*node->children_size);
+	if (node->children == NULL) {
+		free(node);
 		return NULL;
 	}
-	return tree;
+	return node;
+}
+
+pfx_tree_t pfx_tree_init_flags(unsigned flags)
+{
+	struct pfx_tree_root *root = (struct pfx_tree_root *)node_init(
+			sizeof(struct pfx_tree_root), flags);
+	if (root == NULL)
+		return NULL;
+	root->height = 0;
+	root->has_nul = false;
+	return &root->node;
 }
 
 void pfx_tree_destroy(pfx_tree_t tree)
@@ -92,15 +146,19 @@ void pfx_tree_destroy(pfx_tree_t tree)
 bool pfx_tree_insert_safe(pfx_tree_t tree, const wchar_t key[],
 		size_t key_size, void *value)
 {
+	struct pfx_tree_root *root = (struct pfx_tree_root *)tree;
+	const wchar_t *start = key;
+	size_t len = key_size;
 	while (key_size > 0) {
 		bool exists;
-		size_t idx = find_child_idx(tree, key[0], &exists);
+		wchar_t c = fold_key(&root->node, key[0]);
+		size_t idx = find_child_idx(tree, c, &exists);
 		if (!exists) {
 			/* Reallocate the array if too small */
 			if (tree->children_count == tree->children_size) {
 				tree->children_size <<= 1;
-				struct pfx_tree_node **resized =
-					realloc(tree->children, tree->children_size);
+				struct pfx_tree_node **resized = realloc(tree->children,
+						tree->children_size * sizeof(struct pfx_tree_node *));
 				if (resized == NULL) {
 					tree->children_size >>= 1;
 					return false;
@@ -110,12 +168,12 @@ bool pfx_tree_insert_safe(pfx_tree_t tree, const wchar_t key[],
 
 			/* Insertion into children */
 			memmove(tree->children+idx+1, tree->children+idx,
-					(tree->children_count-idx) * sizeof(struct pfx_tree_node));
+					(tree->children_count-idx) * sizeof(struct pfx_tree_node *));
 			++tree->children_count;
-			tree->children[idx] = pfx_tree_init();
+			tree->children[idx] = node_init(sizeof(struct pfx_tree_node), 0);
 			if (tree->children[idx] == NULL)
 				return false;
-			tree->children[idx]->c = key[0];
+			tree->children[idx]->c = c;
 		}
 
 		tree = tree->children[idx];
@@ -132,21 +190,78 @@ bool pfx_tree_insert_safe(pfx_tree_t tree, const wchar_t key[],
 		return false;
 
 	tree->data = value;
+	if (root->height < len)
+		root->height = len;
+	if (wmemchr(start, L'\0', len) != NULL)
+		root->has_nul = true;
 	return true;
 }
 
 ssize_t pfx_tree_height(pfx_tree_t tree)
 {
-	ssize_t height = -1;
 	if (tree == NULL)
-		return height;
+		return -1;
+	return ((const struct pfx_tree_root *)tree)->height;
+}
 
-	for (size_t i = 0; i < tree->children_count; ++i) {
-		ssize_t tmp_height = pfx_tree_height(tree->children[i]);
-		height = height < tmp_height ? tmp_height : height;
+/*
+ * @return True if some key contains a NUL, and so could match in a run of
+ * 	zero bytes
+ */
+bool pfx_tree_has_nul(pfx_tree_t tree)
+{
+	return ((const struct pfx_tree_root *)tree)->has_nul;
+}
+
+static bool walk_node(struct pfx_tree_node *node, wchar_t *key,
+		size_t depth, pfx_tree_walk_cb cb, void *data)
+{
+	if (node->data != NULL && !cb(key, depth, node->data, data))
+		return false;
+
+	for (size_t i = 0; i < node->children_count; ++i) {
+		key[depth] = node->children[i]->c;
+		if (!walk_node(node->children[i], key, depth + 1, cb, data))
+			return false;
 	}
+	return true;
+}
+
+/*
+ * Counts the nodes of the tree and the heap bytes they occupy.
+ */
+void pfx_tree_stats(pfx_tree_t tree, size_t *nodes, size_t *bytes)
+{
+	*nodes += 1;
+	*bytes += sizeof(struct pfx_tree_node) +
+		tree->children_size * sizeof(struct pfx_tree_node *);
+	for (size_t i = 0; i < tree->children_count; ++i)
+		pfx_tree_stats(tree->children[i], nodes, bytes);
+}
+
+/*
+ * Calls cb for every key in sorted order, stopping early if it returns false.
+ * Keys of a case insensitive tree are passed in their folded form.
+ * @return false if cb stopped the walk or the key buffer failed to allocate
+ */
+bool pfx_tree_walk(pfx_tree_t tree, pfx_tree_walk_cb cb, void *data)
+{
+	wchar_t *key = malloc((pfx_tree_height(tree) + 1) * sizeof(wchar_t));
+	if (key == NULL)
+		return false;
 
-	return height + 1;
+	bool ret = walk_node(tree, key, 0, cb, data);
+	free(key);
+	return ret;
+}
+
+/*
+ * @return The table input bytes must be mapped through before being
+ * 	passed to pfx_tree_iter_next()
+ */
+const unsigned char *pfx_tree_fold_table(pfx_tree_t tree)
+{
+	return tree->flags & PFX_TREE_ICASE ? lower_table : identity_table;
 }
 
 pfx_tree_iter_t pfx_tree_get_iter(pfx_tree_t tree)
@@ -163,6 +278,14 @@ pfx_tree_iter_t pfx_tree_iter_next(pfx_tree_iter_t iter, wchar_t c)
 	return iter->children[idx];
 }
 
+/*
+ * Starts loading what the next pfx_tree_iter_next() on iter searches.
+ */
+void pfx_tree_iter_prefetch(pfx_tree_iter_t iter)
+{
+	__builtin_prefetch(iter->children);
+}
+
 void *pfx_tree_iter_data(pfx_tree_iter_t iter)
 {
 	return iter->data;
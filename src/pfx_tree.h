@@ -29,16 +29,27 @@
 #include <unistd.h>
 #include <wchar.h>
 
+/* Match ASCII letters regardless of case */
+#define PFX_TREE_ICASE 0x1
+
 typedef struct pfx_tree_node *pfx_tree_t;
 typedef struct pfx_tree_node *pfx_tree_iter_t;
+typedef bool (*pfx_tree_walk_cb)(const wchar_t key[], size_t key_size,
+		void *value, void *data);
 
 pfx_tree_t pfx_tree_init();
+pfx_tree_t pfx_tree_init_flags(unsigned flags);
 void pfx_tree_destroy(pfx_tree_t tree);
 bool pfx_tree_insert_safe(pfx_tree_t tree, const wchar_t key[], size_t key_size, void *value);
 ssize_t pfx_tree_height(pfx_tree_t tree);
+bool pfx_tree_has_nul(pfx_tree_t tree);
+const unsigned char *pfx_tree_fold_table(pfx_tree_t tree);
+void pfx_tree_stats(pfx_tree_t tree, size_t *nodes, size_t *bytes);
+bool pfx_tree_walk(pfx_tree_t tree, pfx_tree_walk_cb cb, void *data);
 pfx_tree_iter_t pfx_tree_get_iter(pfx_tree_t tree);
 
 pfx_tree_iter_t pfx_tree_iter_next(pfx_tree_iter_t iter, wchar_t c);
+void pfx_tree_iter_prefetch(pfx_tree_iter_t iter);
 void *pfx_tree_iter_data(pfx_tree_iter_t iter);
 
 #endif // PFX_TREE_H
@@ -0,0 +1,141 @@
+/*
+ * ring_buf.c: heap backed ring buffer for streaming input
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ring_buf.h"
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static size_t mapping_size(size_t size, bool huge_pages)
+{
+	if (!huge_pages)
+		return size;
+	return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+void *block_alloc(size_t size, bool huge_pages)
+{
+	void *block;
+	size = mapping_size(size, huge_pages);
+
+	if (huge_pages) {
+		block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED)
+			return block;
+	}
+
+	block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED)
+		return NULL;
+
+	/* Fall back to transparent huge pages if none were reserved */
+	if (huge_pages)
+		madvise(block, size, MADV_HUGEPAGE);
+	return block;
+}
+
+void block_free(void *block, size_t size, bool huge_pages)
+{
+	if (block == NULL)
+		return;
+	munmap(block, mapping_size(size, huge_pages));
+}
+
+bool ring_buf_init(struct ring_buf *ring, size_t min_size, bool huge_pages)
+{
+	size_t size = 1;
+	while (size < min_size) {
+		size <<= 1;
+		if (size == 0) {
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	ring->buf = block_alloc(size, huge_pages);
+	if (ring->buf == NULL)
+		return false;
+
+	ring->size = size;
+	ring->mask = size - 1;
+	ring->head = ring->tail = 0;
+	ring->huge_pages = huge_pages;
+	return true;
+}
+
+void ring_buf_destroy(struct ring_buf *ring)
+{
+	block_free(ring->buf, ring->size, ring->huge_pages);
+	ring->buf = NULL;
+}
+
+/*
+ * Describes up to max bytes of the free space of the ring, which wraps
+ * around the end of the buffer at most once.
+ * @return The number of iovecs filled in
+ */
+int ring_buf_free_iov(const struct ring_buf *ring, struct iovec iov[2],
+		size_t max)
+{
+	size_t free_space = ring->size - ring_buf_count(ring);
+	size_t start = ring->tail & ring->mask;
+	size_t first = ring->size - start;
+	if (free_space > max)
+		free_space = max;
+
+	iov[0].iov_base = ring->buf + start;
+	if (first >= free_space) {
+		iov[0].iov_len = free_space;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = ring->buf;
+	iov[1].iov_len = free_space - first;
+	return 2;
+}
+
+/*
+ * Reads up to max bytes, as many as fit in the free space of the ring,
+ * using a single syscall even when the free space wraps around the end
+ * of the buffer.
+ * @return The number of bytes read, 0 on EOF and -1 on error
+ */
+ssize_t ring_buf_fill(struct ring_buf *ring, int fd, size_t max)
+{
+	struct iovec iov[2];
+	int iovcnt = ring_buf_free_iov(ring, iov, max);
+	ssize_t ret;
+
+	do {
+		ret = readv(fd, iov, iovcnt);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret > 0)
+		ring_buf_commit(ring, ret);
+	return ret;
+}
@@ -0,0 +1,88 @@
+/*
+ * ring_buf.h: heap backed ring buffer for streaming input
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RING_BUF_H
+#define RING_BUF_H
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+struct ring_buf {
+	char *buf;
+	/* Always a power of two so offsets can be masked */
+	size_t size, mask;
+	/* Absolute stream offsets of the first unconsumed byte and end of data */
+	size_t head, tail;
+	bool huge_pages;
+};
+
+void *block_alloc(size_t size, bool huge_pages);
+void block_free(void *block, size_t size, bool huge_pages);
+
+bool ring_buf_init(struct ring_buf *ring, size_t min_size, bool huge_pages);
+void ring_buf_destroy(struct ring_buf *ring);
+int ring_buf_free_iov(const struct ring_buf *ring, struct iovec iov[2],
+		size_t max);
+ssize_t ring_buf_fill(struct ring_buf *ring, int fd, size_t max);
+
+static inline size_t ring_buf_count(const struct ring_buf *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline char ring_buf_at(const struct ring_buf *ring, size_t idx)
+{
+	return ring->buf[(ring->head + idx) & ring->mask];
+}
+
+/*
+ * Reads the byte at an absolute stream offset still held in the ring.
+ */
+static inline char ring_buf_at_offset(const struct ring_buf *ring,
+		size_t offset)
+{
+	return ring->buf[offset & ring->mask];
+}
+
+static inline void ring_buf_commit(struct ring_buf *ring, size_t count)
+{
+	ring->tail += count;
+}
+
+static inline void ring_buf_consume(struct ring_buf *ring, size_t count)
+{
+	ring->head += count;
+}
+
+/*
+ * Moves an empty ring past count bytes of the stream that are not read.
+ */
+static inline void ring_buf_skip(struct ring_buf *ring, size_t count)
+{
+	ring->head += count;
+	ring->tail += count;
+}
+
+#endif // RING_BUF_H
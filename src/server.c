@@ -0,0 +1,561 @@
+/*
+ * server.c: resident substitution service on a Unix socket
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+#define REQUEST_MAGIC 0x53554231
+
+enum request_flags {
+	REQUEST_IN_PLACE = 1 << 0,
+	REQUEST_SRC_FD = 1 << 1,
+	REQUEST_DEST_FD = 1 << 2,
+};
+
+/*
+ * Each request is a single packet holding the header followed by the
+ * paths, which are not NUL terminated. Files passed as descriptors have
+ * no path and ride along as SCM_RIGHTS, the source first.
+ */
+struct request_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t src_len, dest_len;
+};
+
+#define REQUEST_MAX (sizeof(struct request_header) + 2 * PATH_MAX)
+
+#define ACCEPT_BACKOFF_MIN_MS 10
+#define ACCEPT_BACKOFF_MAX_MS 1000
+
+/* An errno value, 0 when the request succeeded */
+struct reply {
+	int32_t error;
+};
+
+struct server {
+	int listen_fd;
+	char *socket_fn;
+	atomic_bool stopping;
+	pfx_tree_t substitutions;
+	size_t longest_replacement;
+	struct substitute_opts opts;
+	pthread_t *workers;
+	size_t worker_count;
+};
+
+static bool socket_addr(const char *socket_fn, struct sockaddr_un *addr)
+{
+	if (strlen(socket_fn) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, socket_fn);
+	return true;
+}
+
+static int connect_socket(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_socket(const char *socket_fn)
+{
+	struct sockaddr_un addr;
+	int fd, probe;
+
+	if (!socket_addr(socket_fn, &addr))
+		return -1;
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		/* Only take the path over from a server that is gone */
+		if (errno != EADDRINUSE)
+			goto listen_fail;
+		probe = connect_socket(&addr);
+		if (probe != -1) {
+			close(probe);
+			errno = EADDRINUSE;
+			goto listen_fail;
+		}
+		if (errno != ECONNREFUSED || unlink(socket_fn) == -1 ||
+				bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+			goto listen_fail;
+	}
+	/*
+	 * Requests write files as the server's user, so only that user may
+	 * connect. Nobody can connect before the listen below.
+	 */
+	if (chmod(socket_fn, 0600) == -1 || listen(fd, SOMAXCONN) == -1)
+		goto listen_fail;
+	return fd;
+
+listen_fail:
+	probe = errno;
+	close(fd);
+	errno = probe;
+	return -1;
+}
+
+/*
+ * Substitutes between whichever files were named and passed, opening the
+ * named ones here. Only a request naming both files can use the cache.
+ */
+static bool substitute_files(const struct server *server,
+		const char *src_fn, int src_fd, const char *dest_fn, int dest_fd)
+{
+	int in_fd = src_fd, out_fd = dest_fd, saved_errno;
+	bool ret = false;
+
+	if (src_fd == -1 && dest_fd == -1)
+		return substitute_file(dest_fn, src_fn, server->substitutions,
+				server->longest_replacement, &server->opts);
+
+	if (in_fd == -1)
+		in_fd = open(src_fn, O_RDONLY | O_CLOEXEC);
+	if (in_fd == -1)
+		return false;
+	if (out_fd == -1)
+		out_fd = open(dest_fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				0666);
+	if (out_fd != -1)
+		ret = substitute_fd(out_fd, in_fd, server->substitutions,
+				server->longest_replacement, &server->opts);
+
+	saved_errno = errno;
+	if (src_fd == -1)
+		close(in_fd);
+	if (dest_fd == -1 && out_fd != -1 && close(out_fd) == -1 && ret) {
+		ret = false;
+		saved_errno = errno;
+	}
+	errno = saved_errno;
+	return ret;
+}
+
+static bool take_path(char *fn, const char **data, uint32_t len)
+{
+	/* Paths resolve against the client's directory, not the server's */
+	if (len > 0 && **data != '/') {
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(fn, *data, len);
+	fn[len] = '\0';
+	*data += len;
+	return true;
+}
+
+static bool handle_request(const struct server *server, const char *buf,
+		size_t len, const int fds[2], size_t fd_count)
+{
+	struct request_header header;
+	char src_fn[PATH_MAX], dest_fn[PATH_MAX];
+	const char *paths = buf + sizeof(header);
+	int src_fd = -1, dest_fd = -1;
+	size_t expected_fds;
+	bool in_place;
+
+	if (len < sizeof(header))
+		goto handle_invalid;
+	memcpy(&header, buf, sizeof(header));
+	in_place = (header.flags & REQUEST_IN_PLACE) != 0;
+	expected_fds = !!(header.flags & REQUEST_SRC_FD) +
+		!!(header.flags & REQUEST_DEST_FD);
+	if (header.magic != REQUEST_MAGIC ||
+			header.src_len >= PATH_MAX || header.dest_len >= PATH_MAX ||
+			sizeof(header) + header.src_len + header.dest_len != len ||
+			expected_fds != fd_count)
+		goto handle_invalid;
+	/* Every file is either named or passed, patching takes only one */
+	if ((header.src_len > 0) == !!(header.flags & REQUEST_SRC_FD))
+		goto handle_invalid;
+	if (in_place ? header.dest_len > 0 || (header.flags & REQUEST_DEST_FD) :
+			(header.dest_len > 0) == !!(header.flags & REQUEST_DEST_FD))
+		goto handle_invalid;
+	if (!take_path(src_fn, &paths, header.src_len) ||
+			!take_path(dest_fn, &paths, header.dest_len))
+		return false;
+	if (header.flags & REQUEST_SRC_FD)
+		src_fd = fds[0];
+	if (header.flags & REQUEST_DEST_FD)
+		dest_fd = fds[expected_fds - 1];
+
+	if (in_place) {
+		if (src_fd != -1)
+			return substitute_in_place_fd(src_fd, server->substitutions,
+					&server->opts);
+		return substitute_in_place(src_fn, server->substitutions,
+				&server->opts);
+	}
+	return substitute_files(server, src_fn, src_fd, dest_fn, dest_fd);
+
+handle_invalid:
+	errno = EINVAL;
+	return false;
+}
+
+/*
+ * Turns away clients running as another user, who could otherwise have
+ * the server overwrite files they cannot write themselves.
+ */
+static bool peer_allowed(int conn)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+		cred.uid == geteuid();
+}
+
+/*
+ * Answers requests on one connection until the client hangs up.
+ */
+static void serve_connection(const struct server *server, int conn)
+{
+	char *buf = malloc(REQUEST_MAX);
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct reply reply;
+	bool allowed = peer_allowed(conn);
+
+	if (buf == NULL)
+		return;
+	while (true) {
+		struct iovec iov = { .iov_base = buf, .iov_len = REQUEST_MAX };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		struct cmsghdr *cmsg;
+		int fds[2] = { -1, -1 };
+		size_t fd_count = 0;
+		ssize_t len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+					cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < count; ++i) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (fd_count < 2)
+					fds[fd_count++] = fd;
+				else
+					close(fd);
+			}
+		}
+
+		if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+			reply.error = EINVAL;
+		else if (!allowed)
+			reply.error = EACCES;
+		else if (handle_request(server, buf, len, fds, fd_count))
+			reply.error = 0;
+		else
+			reply.error = errno != 0 ? errno : EIO;
+		for (size_t i = 0; i < fd_count; ++i)
+			close(fds[i]);
+
+		if (send(conn, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+			break;
+	}
+	free(buf);
+}
+
+/*
+ * Running out of descriptors or memory clears up as other connections
+ * close, so accepting is retried after a growing pause rather than in a
+ * tight loop.
+ */
+static bool accept_retry(int err, int *backoff_ms)
+{
+	switch (err) {
+	case EINTR:
+	case ECONNABORTED:
+		return true;
+	case EMFILE:
+	case ENFILE:
+	case ENOBUFS:
+	case ENOMEM:
+		if (*backoff_ms == 0)
+			fprintf(stderr, "Error accepting a connection: %s, retrying\n",
+					strerror(err));
+		*backoff_ms = *backoff_ms == 0 ? ACCEPT_BACKOFF_MIN_MS
+				: *backoff_ms * 2;
+		if (*backoff_ms > ACCEPT_BACKOFF_MAX_MS)
+			*backoff_ms = ACCEPT_BACKOFF_MAX_MS;
+		poll(NULL, 0, *backoff_ms);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void *worker_run(void *data)
+{
+	struct server *server = data;
+	int backoff_ms = 0;
+
+	/* The listening socket is shut down to wake every worker for exit */
+	while (!atomic_load(&server->stopping)) {
+		int conn = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn == -1) {
+			int err = errno;
+			if (accept_retry(err, &backoff_ms))
+				continue;
+			if (!atomic_load(&server->stopping))
+				fprintf(stderr, "Error accepting a connection: %s, "
+						"stopping the worker\n", strerror(err));
+			break;
+		}
+		backoff_ms = 0;
+		serve_connection(server, conn);
+		close(conn);
+	}
+	return NULL;
+}
+
+static bool same_length(const wchar_t key[], size_t key_size, void *value,
+		void *data)
+{
+	return ((const struct substitution *)value)->replacement_len == key_size;
+}
+
+struct server *server_start(const char *socket_fn, size_t workers,
+		pfx_tree_t substitutions, size_t longest_replacement,
+		const struct substitute_opts *opts)
+{
+	struct server *server;
+	int saved_errno;
+
+	if (workers == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	server = calloc(1, sizeof(struct server));
+	if (server == NULL)
+		return NULL;
+	server->listen_fd = -1;
+	atomic_init(&server->stopping, false);
+	server->substitutions = substitutions;
+	server->longest_replacement = longest_replacement;
+	if (opts != NULL)
+		server->opts = *opts;
+	/* Learnt once here so no request has to walk the rules */
+	server->opts.same_length = pfx_tree_walk(substitutions, same_length,
+			NULL);
+	server->socket_fn = strdup(socket_fn);
+	server->workers = calloc(workers, sizeof(pthread_t));
+	if (server->socket_fn == NULL || server->workers == NULL)
+		goto start_fail;
+
+	server->listen_fd = listen_socket(socket_fn);
+	if (server->listen_fd == -1)
+		goto start_fail;
+	for (; server->worker_count < workers; ++server->worker_count) {
+		int err = pthread_create(&server->workers[server->worker_count],
+				NULL, worker_run, server);
+		if (err != 0) {
+			errno = err;
+			goto start_fail;
+		}
+	}
+	return server;
+
+start_fail:
+	saved_errno = errno;
+	server_stop(server);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Stops accepting, then waits for the workers to finish the connections
+ * they are serving.
+ */
+void server_stop(struct server *server)
+{
+	if (server == NULL)
+		return;
+
+	atomic_store(&server->stopping, true);
+	if (server->listen_fd != -1)
+		shutdown(server->listen_fd, SHUT_RDWR);
+	for (size_t i = 0; i < server->worker_count; ++i)
+		pthread_join(server->workers[i], NULL);
+	if (server->listen_fd != -1) {
+		close(server->listen_fd);
+		unlink(server->socket_fn);
+	}
+	free(server->workers);
+	free(server->socket_fn);
+	free(server);
+}
+
+static bool absolute_path(char *dest, const char *fn)
+{
+	size_t len = strlen(fn), cwd_len = 0;
+
+	if (fn[0] != '/') {
+		if (getcwd(dest, PATH_MAX) == NULL)
+			return false;
+		cwd_len = strlen(dest);
+		dest[cwd_len++] = '/';
+	}
+	if (cwd_len + len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memcpy(dest + cwd_len, fn, len + 1);
+	return true;
+}
+
+static bool add_file(const struct server_file *file, uint32_t fd_flag,
+		struct request_header *header, uint32_t *len, char *fn,
+		int *fds, size_t *fd_count)
+{
+	if (file->fd != -1) {
+		header->flags |= fd_flag;
+		fds[(*fd_count)++] = file->fd;
+		*len = 0;
+		return true;
+	}
+	if (!absolute_path(fn, file->fn))
+		return false;
+	*len = strlen(fn);
+	return true;
+}
+
+bool server_submit(const char *socket_fn, const struct server_file *src,
+		const struct server_file *dest, bool in_place)
+{
+	struct request_header header = { .magic = REQUEST_MAGIC };
+	char src_fn[PATH_MAX], dest_fn[PATH_MAX];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct sockaddr_un addr;
+	struct reply reply;
+	int fds[2], fd, saved_errno;
+	size_t fd_count = 0;
+	ssize_t len;
+	bool ret = false;
+
+	if (in_place)
+		header.flags |= REQUEST_IN_PLACE;
+	if (!add_file(src, REQUEST_SRC_FD, &header, &header.src_len, src_fn,
+				fds, &fd_count))
+		return false;
+	if (!in_place && !add_file(dest, REQUEST_DEST_FD, &header,
+				&header.dest_len, dest_fn, fds, &fd_count))
+		return false;
+
+	struct iovec iov[3] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = src_fn, .iov_len = header.src_len },
+		{ .iov_base = dest_fn, .iov_len = header.dest_len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 3,
+	};
+	if (fd_count > 0) {
+		struct cmsghdr *cmsg;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+	}
+
+	if (!socket_addr(socket_fn, &addr))
+		return false;
+	fd = connect_socket(&addr);
+	if (fd == -1)
+		return false;
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+		goto submit_cleanup;
+	do {
+		len = recv(fd, &reply, sizeof(reply), 0);
+	} while (len == -1 && errno == EINTR);
+	if (len == -1)
+		goto submit_cleanup;
+	if (len != sizeof(reply)) {
+		/* The server went away without answering */
+		errno = ECONNRESET;
+		goto submit_cleanup;
+	}
+	if (reply.error != 0) {
+		errno = reply.error;
+		goto submit_cleanup;
+	}
+	ret = true;
+
+submit_cleanup:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
@@ -0,0 +1,58 @@
+/*
+ * server.h: resident substitution service on a Unix socket
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pfx_tree.h"
+#include "util.h"
+
+/* A file named by a path, or already open when fd is not -1 */
+struct server_file {
+	const char *fn;
+	int fd;
+};
+
+struct server;
+
+/*
+ * Listens on socket_fn and serves requests from a pool of worker threads,
+ * all sharing the rules and options, until server_stop().
+ */
+struct server *server_start(const char *socket_fn, size_t workers,
+		pfx_tree_t substitutions, size_t longest_replacement,
+		const struct substitute_opts *opts);
+void server_stop(struct server *server);
+
+/*
+ * Asks the server on socket_fn to substitute src into dest, or to patch
+ * src when in_place. Errors from the server are returned through errno.
+ */
+bool server_submit(const char *socket_fn, const struct server_file *src,
+		const struct server_file *dest, bool in_place);
+
+#endif // SERVER_H
@@ -22,14 +22,28 @@
  * THE SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
+#include "cache.h"
+#include "dawg.h"
+#include "ring_buf.h"
 #include "util.h"
 
-#define MIN_BUF_SIZE 4096
+static const struct substitute_opts default_opts = {
+	.block_size = DEFAULT_BLOCK_SIZE,
+	.huge_pages = false,
+};
 
 wchar_t *from_utf8(const char *str)
 {
@@ -46,96 +60,1183 @@ wchar_t *from_utf8(const char *str)
 	return ret;
 }
 
-static bool write_all(const void *ptr, size_t size, size_t count, FILE *stream)
+bool parse_size(const char *str, size_t *size)
+{
+	char *end;
+	errno = 0;
+	unsigned long long val = strtoull(str, &end, 10);
+	if (errno != 0 || end == str)
+		return false;
+
+	unsigned shift = 0;
+	switch (*end) {
+		case 'k': case 'K': shift = 10; ++end; break;
+		case 'm': case 'M': shift = 20; ++end; break;
+		case 'g': case 'G': shift = 30; ++end; break;
+	}
+	if (*end != '\0' || val == 0 || (val << shift) >> shift != val) {
+		errno = EINVAL;
+		return false;
+	}
+
+	*size = val << shift;
+	return true;
+}
+
+bool write_all(int fd, const char *ptr, size_t count)
 {
-	size_t written;
-	while (count > 0 && (written = fwrite(ptr, size, count, stream)) > 0) {
+	while (count > 0) {
+		ssize_t written = write(fd, ptr, count);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
 		ptr += written;
 		count -= written;
 	}
-	return count == 0;
-}
-
-static bool replace_until(char *dest, size_t dest_size,
-		const char *src, size_t src_count, size_t stop_at,
-		FILE *out, pfx_tree_t substitutions)
-{
-	size_t dest_offset = 0, tree_offset = 0;
-	pfx_tree_iter_t iter = pfx_tree_get_iter(substitutions);
-
-#define MAYBE_WRITE_AND_COPY(src_inc, buf, num) do {                     \
-		size_t len_ = num, src_inc_ = src_inc;                           \
-		if (dest_offset + len_ > dest_size) {                            \
-			if (!write_all(dest, sizeof(char), dest_offset, out))        \
-				return false;                                            \
-			dest_offset = 0;                                             \
-		}                                                                \
-		memcpy(dest + dest_offset, buf, len_ * sizeof(char));            \
-		src += src_inc_;                                                 \
-		src_count -= src_inc_;                                           \
-		dest_offset += len_;                                             \
-		tree_offset = 0;                                                 \
-		iter = pfx_tree_get_iter(substitutions);                         \
-	} while(0)
-
-	while(src_count > stop_at) {
-		pfx_tree_iter_t next = pfx_tree_iter_next(iter, src[tree_offset]);
-		++tree_offset;
-		if (next == NULL) {
-			MAYBE_WRITE_AND_COPY(1, src, 1);
+	return true;
+}
+
+static bool copy_unsupported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Moves len bytes from the current offset of src_fd, or everything up to
+ * its end for SIZE_MAX, into dest_fd. Each in kernel mechanism is tried in
+ * turn as their support depends on the kinds and filesystems of both
+ * files. Every one of them advances the file offsets, so a later one picks
+ * up where the last left off.
+ */
+bool copy_fd(int dest_fd, int src_fd, size_t len)
+{
+	enum { COPY_RANGE, COPY_SENDFILE, COPY_SPLICE, COPY_RW } method;
+	char buf[64 << 10];
+	ssize_t bytes;
+
+	for (method = COPY_RANGE; len > 0;) {
+		size_t count = len < SSIZE_MAX ? len : SSIZE_MAX;
+		switch (method) {
+			case COPY_RANGE:
+				bytes = copy_file_range(src_fd, NULL, dest_fd, NULL,
+						count, 0);
+				break;
+			case COPY_SENDFILE:
+				bytes = sendfile(dest_fd, src_fd, NULL, count);
+				break;
+			case COPY_SPLICE:
+				bytes = splice(src_fd, NULL, dest_fd, NULL, count,
+						SPLICE_F_MOVE);
+				break;
+			default:
+				bytes = read(src_fd, buf,
+						count < sizeof(buf) ? count : sizeof(buf));
+				if (bytes > 0 && !write_all(dest_fd, buf, bytes))
+					return false;
+		}
+		if (bytes == 0)
+			return true;
+		if (bytes > 0) {
+			if (len != SIZE_MAX)
+				len -= bytes;
 			continue;
 		}
-		iter = next;
+		if (errno == EINTR)
+			continue;
+		if (method == COPY_RW || !copy_unsupported(errno))
+			return false;
+		++method;
+	}
+	return true;
+}
 
-		char *replacement = pfx_tree_iter_data(iter);
-		if (replacement != NULL)
-			MAYBE_WRITE_AND_COPY(tree_offset, replacement, strlen(replacement));
+struct out_buf {
+	char *buf;
+	size_t size, offset;
+	bool huge_pages;
+	int fd;
+	/* When compressing, buf is owned by the writer and swapped on flush */
+	struct codec_writer *writer;
+	size_t matches;
+};
+
+static bool out_buf_flush(struct out_buf *out)
+{
+	if (out->writer != NULL) {
+		if (out->offset == 0)
+			return true;
+		if (!codec_writer_submit(out->writer, out->buf, out->offset))
+			return false;
+		out->buf = codec_writer_block(out->writer);
+		if (out->buf == NULL)
+			return false;
+	} else if (!write_all(out->fd, out->buf, out->offset)) {
+		return false;
 	}
-	return write_all(dest, sizeof(char), dest_offset, out);
+	out->offset = 0;
+	return true;
 }
 
-bool substitute_file(const char *dest_fn, const char *src_fn,
-		pfx_tree_t substitutions, size_t longest_replacement)
+static bool out_buf_write(struct out_buf *out, const char *ptr, size_t count)
 {
-	FILE *in = fopen(src_fn, "r"), *out = fopen(dest_fn, "w");
-	bool ret = false;
-	if (in == NULL || out == NULL)
-		goto substitute_cleanup;
+	if (out->offset + count > out->size && !out_buf_flush(out))
+		return false;
+
+	/* Anything bigger than the buffer gains nothing from being copied */
+	if (count > out->size && out->writer == NULL)
+		return write_all(out->fd, ptr, count);
+
+	while (count > out->size - out->offset) {
+		size_t len = out->size - out->offset;
+		memcpy(out->buf + out->offset, ptr, len);
+		out->offset += len;
+		ptr += len;
+		count -= len;
+		if (!out_buf_flush(out))
+			return false;
+	}
+	memcpy(out->buf + out->offset, ptr, count);
+	out->offset += count;
+	return true;
+}
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t count)
+{
+	size_t total = 0;
+	while (total < count) {
+		ssize_t bytes = read(fd, buf + total, count - total);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1)
+			return -1;
+		if (bytes == 0)
+			break;
+		total += bytes;
+	}
+	return total;
+}
+
+static ssize_t input_fill(struct ring_buf *ring, int fd,
+		struct codec_reader *reader, size_t max)
+{
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t ret;
+
+	if (reader == NULL)
+		return ring_buf_fill(ring, fd, max);
+
+	iovcnt = ring_buf_free_iov(ring, iov, max);
+	ret = codec_reader_readv(reader, iov, iovcnt);
+	if (ret > 0)
+		ring_buf_commit(ring, ret);
+	return ret;
+}
+
+/*
+ * Copies the first count bytes of the ring into the output, splitting the
+ * copy where the data wraps around the end of the ring.
+ */
+static bool out_buf_write_ring(struct out_buf *out,
+		const struct ring_buf *ring, size_t count)
+{
+	size_t start = ring->head & ring->mask;
+	size_t first = ring->size - start;
+	if (first > count)
+		first = count;
+
+	return out_buf_write(out, ring->buf + start, first) &&
+		out_buf_write(out, ring->buf, count - first);
+}
+
+/*
+ * Receives the input split into runs of literal bytes and matches. Both
+ * start at the head of the ring, which is consumed once they return.
+ * Once the replacement limit is reached the next len bytes of fd or
+ * reader, SIZE_MAX for all of them, are handed to rest in one go. Holes
+ * of sparse input are passed to hole without being read.
+ */
+struct match_sink {
+	bool (*literal)(void *data, const struct ring_buf *ring, size_t count);
+	bool (*match)(void *data, const struct ring_buf *ring, size_t len,
+			const struct substitution *sub);
+	bool (*rest)(void *data, int fd, struct codec_reader *reader,
+			size_t len);
+	bool (*hole)(void *data, off_t len);
+	void *data;
+};
+
+static bool rewrite_literal(void *data, const struct ring_buf *ring,
+		size_t count)
+{
+	return out_buf_write_ring(data, ring, count);
+}
+
+static bool rewrite_match(void *data, const struct ring_buf *ring,
+		size_t len, const struct substitution *sub)
+{
+	struct out_buf *out = data;
+	++out->matches;
+	return out_buf_write(out, sub->replacement, sub->replacement_len);
+}
+
+static bool rewrite_rest(void *data, int fd, struct codec_reader *reader,
+		size_t len)
+{
+	struct out_buf *out = data;
+
+	/* Plain files never need to pass through user space */
+	if (reader == NULL && out->writer == NULL)
+		return out_buf_flush(out) && copy_fd(out->fd, fd, len);
+
+	while (len > 0) {
+		struct iovec iov;
+		ssize_t bytes;
+
+		if (out->offset == out->size && !out_buf_flush(out))
+			return false;
+		iov.iov_base = out->buf + out->offset;
+		iov.iov_len = out->size - out->offset;
+		if (iov.iov_len > len)
+			iov.iov_len = len;
+		bytes = reader != NULL ? codec_reader_readv(reader, &iov, 1) :
+			readv(fd, &iov, 1);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return bytes == 0;
+		out->offset += bytes;
+		if (len != SIZE_MAX)
+			len -= bytes;
+	}
+	return true;
+}
+
+/*
+ * Leaves a hole in the output by seeking past it, the file having been
+ * truncated when opened.
+ */
+static bool rewrite_hole(void *data, off_t len)
+{
+	struct out_buf *out = data;
+	return out_buf_flush(out) && lseek(out->fd, len, SEEK_CUR) != -1;
+}
+
+static bool patch_literal(void *data, const struct ring_buf *ring,
+		size_t count)
+{
+	return true;
+}
+
+/*
+ * Writes the replacement over the needle, the ring head being the
+ * offset of the match in the file.
+ */
+static bool patch_match(void *data, const struct ring_buf *ring,
+		size_t len, const struct substitution *sub)
+{
+	const char *replacement = sub->replacement;
+	int fd = *(int *)data;
+	size_t written = 0;
+
+	if (sub->replacement_len != len) {
+		errno = EINVAL;
+		return false;
+	}
+
+	/* Leave the page clean when the bytes are already in place */
+	size_t same = 0;
+	while (same < len && ring_buf_at(ring, same) == replacement[same])
+		++same;
+	if (same == len)
+		return true;
+
+	while (written < len) {
+		ssize_t bytes = pwrite(fd, replacement + written, len - written,
+				ring->head + written);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1)
+			return false;
+		written += bytes;
+	}
+	return true;
+}
+
+static bool patch_rest(void *data, int fd, struct codec_reader *reader,
+		size_t len)
+{
+	return true;
+}
+
+static bool patch_hole(void *data, off_t len)
+{
+	return true;
+}
+
+struct match_list {
+	struct out_buf out;
+	enum list_format format;
+};
+
+/*
+ * Records where the match starts in the input, which for compressed input
+ * is an offset into the decompressed stream.
+ */
+static bool list_match(void *data, const struct ring_buf *ring,
+		size_t len, const struct substitution *sub)
+{
+	struct match_list *list = data;
+	char record[64];
+	int record_len;
+
+	++list->out.matches;
+	if (list->format == LIST_BINARY) {
+		uint64_t offset = htole64(ring->head);
+		uint32_t id = htole32(sub->id), match_len = htole32(len);
+		memcpy(record, &offset, sizeof(offset));
+		memcpy(record + 8, &id, sizeof(id));
+		memcpy(record + 12, &match_len, sizeof(match_len));
+		record_len = LIST_RECORD_SIZE;
+	} else {
+		record_len = snprintf(record, sizeof(record), "%zu\t%zu\t%zu\n",
+				ring->head, sub->id, len);
+	}
+	return out_buf_write(&list->out, record, record_len);
+}
+
+static bool list_literal(void *data, const struct ring_buf *ring,
+		size_t count)
+{
+	return true;
+}
+
+/* Nothing is left to list once the limit is reached */
+static bool list_rest(void *data, int fd, struct codec_reader *reader,
+		size_t len)
+{
+	return true;
+}
+
+static bool list_hole(void *data, off_t len)
+{
+	return true;
+}
+
+/*
+ * Replacement counts for one file, kept apart from the shared tree.
+ */
+struct match_limits {
+	/* Matching stops once total reaches max, 0 for no limit */
+	size_t max, total;
+	/* Indexed by rule id, grown as rules with their own limit match */
+	size_t *counts, counts_size;
+};
+
+static bool limits_done(const struct match_limits *limits)
+{
+	return limits->max > 0 && limits->total >= limits->max;
+}
+
+static bool limits_reserve(struct match_limits *limits, size_t id)
+{
+	size_t size = limits->counts_size > 0 ? limits->counts_size : 16;
+	size_t *resized;
+
+	if (id < limits->counts_size)
+		return true;
+	while (size <= id)
+		size <<= 1;
+	resized = realloc(limits->counts, size * sizeof(size_t));
+	if (resized == NULL)
+		return false;
+	memset(resized + limits->counts_size, 0,
+			(size - limits->counts_size) * sizeof(size_t));
+	limits->counts = resized;
+	limits->counts_size = size;
+	return true;
+}
+
+/*
+ * Steps through the substitution tree, or through the automaton built
+ * from it when one is given.
+ */
+struct matcher {
+	pfx_tree_t tree;
+	const struct dawg *dawg;
+	const unsigned char *fold;
+	size_t height;
+	/* Cursors walked in lockstep, with their scratch while matching */
+	size_t lane_count;
+	struct match_lanes *lanes;
+};
+
+struct match_iter {
+	pfx_tree_iter_t node;
+	struct dawg_iter state;
+};
+
+static void matcher_init(struct matcher *matcher, pfx_tree_t tree,
+		const struct substitute_opts *opts)
+{
+	const struct dawg *dawg = opts->dawg;
+	matcher->tree = tree;
+	matcher->dawg = dawg;
+	matcher->lane_count = opts->lanes > 1 ? opts->lanes : 1;
+	matcher->lanes = NULL;
+	if (dawg != NULL) {
+		matcher->fold = dawg_fold_table(dawg);
+		matcher->height = dawg_height(dawg);
+	} else {
+		matcher->fold = pfx_tree_fold_table(tree);
+		matcher->height = pfx_tree_height(tree);
+	}
+}
+
+static inline void matcher_reset(const struct matcher *matcher,
+		struct match_iter *iter)
+{
+	if (matcher->dawg != NULL)
+		dawg_iter_init(matcher->dawg, &iter->state);
+	else
+		iter->node = pfx_tree_get_iter(matcher->tree);
+}
+
+static inline bool matcher_next(const struct matcher *matcher,
+		struct match_iter *iter, char c)
+{
+	unsigned char folded = matcher->fold[(unsigned char)c];
+	if (matcher->dawg != NULL)
+		return dawg_iter_next(matcher->dawg, &iter->state, folded);
+
+	pfx_tree_iter_t next = pfx_tree_iter_next(iter->node, folded);
+	if (next == NULL)
+		return false;
+	iter->node = next;
+	return true;
+}
+
+static inline const struct substitution *matcher_data(
+		const struct matcher *matcher, const struct match_iter *iter)
+{
+	if (matcher->dawg != NULL)
+		return dawg_iter_data(matcher->dawg, &iter->state);
+	return pfx_tree_iter_data(iter->node);
+}
+
+static inline void matcher_prefetch(const struct matcher *matcher,
+		const struct match_iter *iter)
+{
+	if (matcher->dawg != NULL)
+		dawg_iter_prefetch(matcher->dawg, &iter->state);
+	else
+		pfx_tree_iter_prefetch(iter->node);
+}
+
+/* Input positions each cursor covers per round of the interleaved walk */
+#define LANE_SLICE 512
+
+struct match_candidate {
+	size_t offset, len;
+	const struct substitution *sub;
+};
+
+struct lane {
+	/* Absolute offsets of the position being tried and the slice end */
+	size_t offset, end, depth;
+	struct match_iter iter;
+};
+
+/*
+ * Each cursor records the match at every position of its slice, so at
+ * most LANE_SLICE candidates, in its own run of candidates.
+ */
+struct match_lanes {
+	struct lane *lanes;
+	struct match_candidate *candidates;
+	size_t *counts;
+};
+
+static struct match_lanes *lanes_alloc(size_t lane_count)
+{
+	struct match_lanes *lanes = malloc(sizeof(struct match_lanes));
+	if (lanes == NULL)
+		return NULL;
+	lanes->lanes = malloc(lane_count * sizeof(struct lane));
+	lanes->candidates = malloc(lane_count * LANE_SLICE *
+			sizeof(struct match_candidate));
+	lanes->counts = malloc(lane_count * sizeof(size_t));
+	if (lanes->lanes == NULL || lanes->candidates == NULL ||
+			lanes->counts == NULL) {
+		free(lanes->lanes);
+		free(lanes->candidates);
+		free(lanes->counts);
+		free(lanes);
+		return NULL;
+	}
+	return lanes;
+}
+
+static void lanes_free(struct match_lanes *lanes)
+{
+	if (lanes == NULL)
+		return;
+	free(lanes->lanes);
+	free(lanes->candidates);
+	free(lanes->counts);
+	free(lanes);
+}
 
-	{
-		size_t height = pfx_tree_height(substitutions);
-		size_t sbuf_size = (height+1) * 5, offset = 0;
-		size_t obuf_size = (longest_replacement+1) * 5;
-		if (sbuf_size < MIN_BUF_SIZE)
-			sbuf_size = MIN_BUF_SIZE;
-		char sbuf[sbuf_size], obuf[obuf_size];
-		ssize_t in_bytes, replaced;
-
-		while((in_bytes = fread(sbuf + offset, sizeof(char),
-						sbuf_size - offset, in)) > 0) {
-			offset += in_bytes;
-			if (offset < height)
+/*
+ * Finds the match starting at every position from start to end, split
+ * into one slice per cursor. The cursors take a step each in turn and
+ * prefetch the node of their next step, so the cache misses of separate
+ * walks overlap instead of each stalling the core on its own.
+ */
+static void lanes_scan(const struct ring_buf *ring,
+		const struct matcher *matcher, size_t start, size_t end)
+{
+	struct match_lanes *scratch = matcher->lanes;
+	size_t lane_count = matcher->lane_count, active = 0;
+	size_t slice = (end - start + lane_count - 1) / lane_count;
+
+	for (size_t i = 0; i < lane_count; ++i) {
+		struct lane *lane = &scratch->lanes[i];
+		lane->offset = start + i * slice;
+		lane->end = lane->offset + slice < end ? lane->offset + slice : end;
+		lane->depth = 0;
+		matcher_reset(matcher, &lane->iter);
+		scratch->counts[i] = 0;
+		if (lane->offset < lane->end)
+			++active;
+	}
+
+	while (active > 0) {
+		for (size_t i = 0; i < lane_count; ++i) {
+			struct lane *lane = &scratch->lanes[i];
+			const struct substitution *sub = NULL;
+			size_t at = lane->offset + lane->depth;
+
+			if (lane->offset >= lane->end)
 				continue;
+			if (at < ring->tail && matcher_next(matcher, &lane->iter,
+						ring_buf_at_offset(ring, at))) {
+				++lane->depth;
+				sub = matcher_data(matcher, &lane->iter);
+				if (sub == NULL) {
+					matcher_prefetch(matcher, &lane->iter);
+					continue;
+				}
+				scratch->candidates[i * LANE_SLICE + scratch->counts[i]++] =
+					(struct match_candidate) {
+						.offset = lane->offset,
+						.len = lane->depth,
+						.sub = sub,
+					};
+			}
+
+			/* Move on to the next position whether or not it matched */
+			++lane->offset;
+			lane->depth = 0;
+			matcher_reset(matcher, &lane->iter);
+			if (lane->offset == lane->end)
+				--active;
+		}
+	}
+}
+
+/*
+ * The interleaved counterpart of replace_until(). Knowing the match at
+ * every position, the candidates are applied in order, skipping those
+ * inside an earlier replacement or over a rule limit, which yields
+ * exactly the matches of the single cursor walk.
+ */
+static bool replace_lanes(struct ring_buf *ring, size_t stop_at,
+		const struct match_sink *sink, const struct matcher *matcher,
+		struct match_limits *limits)
+{
+	struct match_lanes *scratch = matcher->lanes;
+	size_t chunk = matcher->lane_count * LANE_SLICE;
+	size_t start, end, stop;
+
+	if (ring_buf_count(ring) <= stop_at)
+		return true;
+	end = ring->tail - stop_at;
+	for (start = ring->head; start < end && !limits_done(limits);
+			start += chunk) {
+		size_t chunk_end = end - start > chunk ? start + chunk : end;
+		lanes_scan(ring, matcher, start, chunk_end);
+
+		for (size_t i = 0; i < matcher->lane_count; ++i) {
+			const struct match_candidate *cand =
+				scratch->candidates + i * LANE_SLICE;
+			for (size_t j = 0; j < scratch->counts[i]; ++j) {
+				const struct substitution *sub = cand[j].sub;
+				if (cand[j].offset < ring->head)
+					continue;
+
+				/* A rule past its limit reads as literal bytes */
+				if (sub->max_replacements > 0) {
+					if (!limits_reserve(limits, sub->id))
+						return false;
+					if (limits->counts[sub->id] >= sub->max_replacements)
+						continue;
+					++limits->counts[sub->id];
+				}
+
+				if (!sink->literal(sink->data, ring,
+							cand[j].offset - ring->head))
+					return false;
+				ring_buf_consume(ring, cand[j].offset - ring->head);
+				if (!sink->match(sink->data, ring, cand[j].len, sub))
+					return false;
+				ring_buf_consume(ring, cand[j].len);
+
+				++limits->total;
+				if (limits_done(limits))
+					goto replace_lanes_done;
+			}
+		}
+	}
+
+replace_lanes_done:
+	/* Nothing past the last replacement can change */
+	stop = limits_done(limits) ? ring->tail : end;
+	if (stop > ring->head) {
+		if (!sink->literal(sink->data, ring, stop - ring->head))
+			return false;
+		ring_buf_consume(ring, stop - ring->head);
+	}
+	return true;
+}
+
+/*
+ * Feeds matches from the ring to the sink until at most stop_at bytes
+ * remain, so that a match spanning the next read is never split.
+ */
+static bool replace_until(struct ring_buf *ring, size_t stop_at,
+		const struct match_sink *sink, const struct matcher *matcher,
+		struct match_limits *limits)
+{
+	/* Literal bytes are batched up to start and copied out on each match */
+	size_t start = 0, tree_offset = 0, count = ring_buf_count(ring);
+	struct match_iter iter;
+
+	if (matcher->lanes != NULL)
+		return replace_lanes(ring, stop_at, sink, matcher, limits);
+	matcher_reset(matcher, &iter);
 
-			if (!replace_until(obuf, obuf_size, sbuf, offset, height,
-						out, substitutions))
-				goto substitute_cleanup;
+	while (count - start > stop_at) {
+		if (start + tree_offset >= count || !matcher_next(matcher, &iter,
+					ring_buf_at(ring, start + tree_offset))) {
+			++start;
+			tree_offset = 0;
+			matcher_reset(matcher, &iter);
+			continue;
+		}
+		++tree_offset;
+
+		const struct substitution *sub = matcher_data(matcher, &iter);
+		if (sub == NULL)
+			continue;
 
-			memmove(sbuf, sbuf + offset - height, height);
-			offset = height;
+		/* A rule past its limit reads as literal bytes */
+		if (sub->max_replacements > 0) {
+			if (!limits_reserve(limits, sub->id))
+				return false;
+			if (limits->counts[sub->id] >= sub->max_replacements) {
+				++start;
+				tree_offset = 0;
+				matcher_reset(matcher, &iter);
+				continue;
+			}
+			++limits->counts[sub->id];
 		}
-		if (in_bytes == -1)
-			goto substitute_cleanup;
-		if (!replace_until(obuf, obuf_size, sbuf, offset, 0,
-					out, substitutions))
-			goto substitute_cleanup;
+
+		if (!sink->literal(sink->data, ring, start))
+			return false;
+		ring_buf_consume(ring, start);
+		if (!sink->match(sink->data, ring, tree_offset, sub))
+			return false;
+		ring_buf_consume(ring, tree_offset);
+		count -= start + tree_offset;
+		start = tree_offset = 0;
+		matcher_reset(matcher, &iter);
+
+		/* Nothing past the last replacement can change */
+		++limits->total;
+		if (limits_done(limits))
+			start = count;
 	}
+	if (!sink->literal(sink->data, ring, start))
+		return false;
+	ring_buf_consume(ring, start);
+	return true;
+}
+
+/*
+ * Runs the next len bytes of input, or all of it for SIZE_MAX, through the
+ * matcher, holding back the last height bytes of every read until the
+ * next one. Reading stops early once the replacement limit is reached.
+ */
+static bool match_stream(struct ring_buf *ring, int fd,
+		struct codec_reader *reader, const struct matcher *matcher,
+		const struct match_sink *sink, struct match_limits *limits,
+		size_t len)
+{
+	size_t height = matcher->height;
+	ssize_t in_bytes = 0;
+
+	while (len > 0 && !limits_done(limits)) {
+		/* Reading into a full ring returns nothing without being the end */
+		if (ring_buf_count(ring) == ring->size) {
+			if (!replace_until(ring, height, sink, matcher, limits))
+				return false;
+			continue;
+		}
+		in_bytes = input_fill(ring, fd, reader, len);
+		if (in_bytes <= 0)
+			break;
+		if (len != SIZE_MAX)
+			len -= in_bytes;
+		if (ring_buf_count(ring) <= height)
+			continue;
+		if (!replace_until(ring, height, sink, matcher, limits))
+			return false;
+	}
+	return in_bytes != -1 && replace_until(ring, 0, sink, matcher, limits);
+}
+
+/*
+ * @return True if some needle could match inside a run of zero bytes. The
+ * automaton is built from the tree, so it holds the same needles.
+ */
+static bool matcher_matches_zero(const struct matcher *matcher)
+{
+	return pfx_tree_has_nul(matcher->tree);
+}
+
+/*
+ * @return The size of fd if it is a regular file with holes, otherwise -1
+ */
+static off_t sparse_file_size(int fd)
+{
+	struct stat st;
+	off_t hole;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+	hole = lseek(fd, 0, SEEK_HOLE);
+	if (lseek(fd, 0, SEEK_SET) == -1 || hole == -1 || hole >= st.st_size)
+		return -1;
+	return st.st_size;
+}
+
+/*
+ * @return True if holes can be recreated by seeking over them in fd, which
+ *         must be a regular file with nothing past the current offset and
+ *         not opened for appending
+ */
+static bool output_takes_holes(int fd)
+{
+	struct stat st;
+	int flags;
+	off_t offset;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return false;
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || (flags & O_APPEND))
+		return false;
+	offset = lseek(fd, 0, SEEK_CUR);
+	return offset != -1 && st.st_size <= offset;
+}
+
+/*
+ * Runs only the data of a sparse file through the matcher. With no needle
+ * able to match a zero byte, a hole both holds no match and ends any
+ * partial one, so it can be passed over unread. The ring is moved along
+ * with the file to keep its offsets those of the file.
+ */
+static bool match_sparse(struct ring_buf *ring, int fd,
+		const struct matcher *matcher, const struct match_sink *sink,
+		struct match_limits *limits, off_t size)
+{
+	off_t offset, data, hole;
+
+	for (offset = 0; offset < size; offset = hole) {
+		data = lseek(fd, offset, SEEK_DATA);
+		if (data == -1 && errno != ENXIO)
+			return false;
+		/* Nothing but a hole is left */
+		if (data == -1 || data > size)
+			data = size;
+		hole = data < size ? lseek(fd, data, SEEK_HOLE) : size;
+		if (hole == -1 || lseek(fd, data, SEEK_SET) == -1)
+			return false;
+		if (hole > size)
+			hole = size;
+
+		if (data > offset) {
+			if (!sink->hole(sink->data, data - offset))
+				return false;
+			ring_buf_skip(ring, data - offset);
+		}
+		if (!match_stream(ring, fd, NULL, matcher, sink, limits,
+					hole - data))
+			return false;
+		if ((off_t)ring->tail < hole) {
+			if (!sink->rest(sink->data, fd, NULL, hole - ring->tail))
+				return false;
+			ring_buf_skip(ring, hole - ring->tail);
+		}
+	}
+	return true;
+}
+
+/*
+ * Runs the whole input through the matcher, sparse_size being the size of
+ * an input whose holes can be skipped or -1.
+ */
+static bool match_input(struct ring_buf *ring, int fd,
+		struct codec_reader *reader, struct matcher *matcher,
+		const struct match_sink *sink, size_t max_replacements,
+		off_t sparse_size)
+{
+	struct match_limits limits = { .max = max_replacements };
+	bool ret;
+
+	if (matcher->lane_count > 1) {
+		matcher->lanes = lanes_alloc(matcher->lane_count);
+		if (matcher->lanes == NULL)
+			return false;
+	}
+	if (sparse_size != -1) {
+		ret = match_sparse(ring, fd, matcher, sink, &limits, sparse_size);
+	} else {
+		ret = match_stream(ring, fd, reader, matcher, sink, &limits,
+				SIZE_MAX);
+		if (ret && limits_done(&limits))
+			ret = sink->rest(sink->data, fd, reader, SIZE_MAX);
+	}
+	free(limits.counts);
+	lanes_free(matcher->lanes);
+	matcher->lanes = NULL;
+	return ret;
+}
+
+/*
+ * Fills in defaults for a missing or zeroed set of options.
+ */
+static const struct substitute_opts *resolve_opts(
+		struct substitute_opts *local, const struct substitute_opts *opts)
+{
+	*local = opts != NULL ? *opts : default_opts;
+	if (local->block_size == 0)
+		local->block_size = DEFAULT_BLOCK_SIZE;
+	return local;
+}
+
+static bool ring_init(struct ring_buf *ring, size_t height,
+		const struct substitute_opts *opts)
+{
+	size_t ring_size = opts->block_size;
+
+	/*
+	 * Always leave room to read past a tail of height bytes, including
+	 * the first read made after the sniffed magic bytes
+	 */
+	if (ring_size < (height+1) * 2)
+		ring_size = (height+1) * 2;
+	if (ring_size < CODEC_MAGIC_LEN + height + 1)
+		ring_size = CODEC_MAGIC_LEN + height + 1;
+	return ring_buf_init(ring, ring_size, opts->huge_pages);
+}
+
+/*
+ * Sniffs the format of in_fd from its first bytes, starting a reader for
+ * compressed input. The bytes read are left in the ring, unless the input
+ * is sparse and holes may be skipped, in which case sparse is set to its
+ * size and the file rewound for the sparse walk.
+ */
+static bool input_start(struct ring_buf *ring, int in_fd,
+		const struct matcher *matcher, bool skip_holes,
+		const struct substitute_opts *opts, struct codec_reader **reader,
+		off_t *sparse)
+{
+	unsigned char magic[CODEC_MAGIC_LEN];
+	ssize_t in_bytes;
+	enum codec in_codec;
+
+	*reader = NULL;
+	*sparse = -1;
+	if (skip_holes) {
+		*sparse = sparse_file_size(in_fd);
+		if (*sparse != -1 && matcher_matches_zero(matcher))
+			*sparse = -1;
+	}
+
+	in_bytes = read_full(in_fd, magic, CODEC_MAGIC_LEN);
+	if (in_bytes == -1)
+		return false;
+	in_codec = opts->decompress ? codec_detect(magic, in_bytes) : CODEC_NONE;
+	if (in_codec != CODEC_NONE) {
+		*sparse = -1;
+		*reader = codec_reader_start(in_fd, in_codec, magic, in_bytes,
+				opts->block_size);
+		return *reader != NULL;
+	}
+	if (*sparse != -1)
+		return lseek(in_fd, 0, SEEK_SET) != -1;
+	memcpy(ring->buf, magic, in_bytes);
+	ring_buf_commit(ring, in_bytes);
+	return true;
+}
+
+/*
+ * Rewrites in_fd into out_fd, leaving both open for the caller to close.
+ */
+static bool substitute_fds(int out_fd, int in_fd, pfx_tree_t substitutions,
+		size_t longest_replacement, const struct substitute_opts *opts,
+		bool *unchanged)
+{
+	struct ring_buf ring = { .buf = NULL };
+	struct out_buf out = { .buf = NULL, .fd = out_fd, .writer = NULL };
+	struct codec_reader *reader = NULL;
+	struct match_sink sink = {
+		.literal = rewrite_literal,
+		.match = rewrite_match,
+		.rest = rewrite_rest,
+		.hole = rewrite_hole,
+		.data = &out,
+	};
+	struct matcher matcher;
+	off_t sparse = -1;
+	int saved_errno;
+	bool ret = false, failed;
+
+	matcher_init(&matcher, substitutions, opts);
+	if (!ring_init(&ring, matcher.height, opts))
+		goto substitute_fds_cleanup;
+
+	out.size = opts->block_size;
+	if (opts->compress != CODEC_NONE) {
+		out.writer = codec_writer_start(out.fd, opts->compress, out.size);
+		if (out.writer == NULL)
+			goto substitute_fds_cleanup;
+		out.buf = codec_writer_block(out.writer);
+	} else {
+		if (out.size < longest_replacement)
+			out.size = longest_replacement;
+		out.huge_pages = opts->huge_pages;
+		out.buf = block_alloc(out.size, out.huge_pages);
+	}
+	if (out.buf == NULL)
+		goto substitute_fds_cleanup;
+
+	/*
+	 * Holes can only be recreated in an uncompressed output, otherwise
+	 * they are read and written out as zeros
+	 */
+	if (!input_start(&ring, in_fd, &matcher,
+				out.writer == NULL && output_takes_holes(out.fd), opts,
+				&reader, &sparse))
+		goto substitute_fds_cleanup;
+
+	if (!match_input(&ring, in_fd, reader, &matcher, &sink,
+				opts->max_replacements, sparse) ||
+			!out_buf_flush(&out))
+		goto substitute_fds_cleanup;
+	/* Seeking over a trailing hole leaves the size to be set */
+	if (sparse != -1) {
+		off_t end = lseek(out.fd, 0, SEEK_CUR);
+		if (end == -1 || ftruncate(out.fd, end) == -1)
+			goto substitute_fds_cleanup;
+	}
+	*unchanged = out.matches == 0 && reader == NULL && out.writer == NULL;
 
 	ret = true;
+substitute_fds_cleanup:
+	/* Tearing down the pipelines must not mask the original error */
+	saved_errno = errno;
+	failed = !ret;
+	codec_reader_finish(reader);
+	if (out.writer != NULL) {
+		if (!codec_writer_finish(out.writer, !ret))
+			ret = false;
+	} else {
+		block_free(out.buf, out.size, out.huge_pages);
+	}
+	if (ring.buf != NULL)
+		ring_buf_destroy(&ring);
+	if (failed)
+		errno = saved_errno;
+	return ret;
+}
+
+bool substitute_file(const char *dest_fn, const char *src_fn,
+		pfx_tree_t substitutions, size_t longest_replacement,
+		const struct substitute_opts *opts)
+{
+	struct substitute_opts local_opts;
+	struct cache_key key = { .name = "" };
+	int in_fd, out_fd = -1, saved_errno;
+	bool ret = false, failed, unchanged = false;
+
+	opts = resolve_opts(&local_opts, opts);
+
+	in_fd = open(src_fn, O_RDONLY);
+	if (in_fd == -1)
+		goto substitute_cleanup;
+	if (!codec_supported(opts->compress)) {
+		errno = ENOTSUP;
+		goto substitute_cleanup;
+	}
+	if (opts->cache != NULL &&
+			cache_fetch(opts->cache, in_fd, dest_fn, &key) == 1) {
+		ret = true;
+		goto substitute_cleanup;
+	}
+	out_fd = open(dest_fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd == -1)
+		goto substitute_cleanup;
+
+	ret = substitute_fds(out_fd, in_fd, substitutions, longest_replacement,
+			opts, &unchanged);
 substitute_cleanup:
-	if (in != NULL)
-		fclose(in);
-	if (out != NULL)
-		fclose(out);
+	saved_errno = errno;
+	failed = !ret;
+	if (in_fd != -1)
+		close(in_fd);
+	if (out_fd != -1 && close(out_fd) == -1)
+		ret = false;
+	if (ret && out_fd != -1 && opts->cache != NULL)
+		cache_store(opts->cache, &key, dest_fn, unchanged);
+	if (failed)
+		errno = saved_errno;
+	return ret;
+}
+
+bool substitute_fd(int dest_fd, int src_fd, pfx_tree_t substitutions,
+		size_t longest_replacement, const struct substitute_opts *opts)
+{
+	struct substitute_opts local_opts;
+	bool unchanged;
+
+	opts = resolve_opts(&local_opts, opts);
+	if (!codec_supported(opts->compress)) {
+		errno = ENOTSUP;
+		return false;
+	}
+	return substitute_fds(dest_fd, src_fd, substitutions,
+			longest_replacement, opts, &unchanged);
+}
+
+bool list_matches(int out_fd, const char *src_fn, pfx_tree_t substitutions,
+		enum list_format format, const struct substitute_opts *opts)
+{
+	struct ring_buf ring = { .buf = NULL };
+	struct match_list list = {
+		.out = { .buf = NULL, .fd = out_fd, .writer = NULL },
+		.format = format,
+	};
+	struct match_sink sink = {
+		.literal = list_literal,
+		.match = list_match,
+		.rest = list_rest,
+		.hole = list_hole,
+		.data = &list,
+	};
+	struct codec_reader *reader = NULL;
+	struct substitute_opts local_opts;
+	struct matcher matcher;
+	off_t sparse;
+	int in_fd, saved_errno;
+	bool ret = false, failed;
+
+	opts = resolve_opts(&local_opts, opts);
+
+	in_fd = open(src_fn, O_RDONLY);
+	if (in_fd == -1)
+		return false;
+	matcher_init(&matcher, substitutions, opts);
+	if (!ring_init(&ring, matcher.height, opts))
+		goto list_cleanup;
+	list.out.size = opts->block_size;
+	list.out.huge_pages = opts->huge_pages;
+	list.out.buf = block_alloc(list.out.size, list.out.huge_pages);
+	if (list.out.buf == NULL)
+		goto list_cleanup;
+
+	/* Holes hold no matches, so they are always skipped */
+	if (!input_start(&ring, in_fd, &matcher, true, opts, &reader, &sparse) ||
+			!match_input(&ring, in_fd, reader, &matcher, &sink,
+				opts->max_replacements, sparse) ||
+			!out_buf_flush(&list.out))
+		goto list_cleanup;
+	ret = true;
+
+list_cleanup:
+	saved_errno = errno;
+	failed = !ret;
+	codec_reader_finish(reader);
+	block_free(list.out.buf, list.out.size, list.out.huge_pages);
+	if (ring.buf != NULL)
+		ring_buf_destroy(&ring);
+	close(in_fd);
+	if (failed)
+		errno = saved_errno;
+	return ret;
+}
+
+bool substitute_in_place_fd(int fd, pfx_tree_t substitutions,
+		const struct substitute_opts *opts)
+{
+	struct ring_buf ring = { .buf = NULL };
+	struct substitute_opts local_opts;
+	struct matcher matcher;
+	struct match_sink sink = {
+		.literal = patch_literal,
+		.match = patch_match,
+		.rest = patch_rest,
+		.hole = patch_hole,
+		.data = &fd,
+	};
+	bool ret = false;
+	off_t sparse;
+
+	opts = resolve_opts(&local_opts, opts);
+
+	/* Refuse up front rather than leaving the file half patched */
+	if (!opts->same_length) {
+		errno = EINVAL;
+		return false;
+	}
+
+	matcher_init(&matcher, substitutions, opts);
+	sparse = sparse_file_size(fd);
+	if (sparse != -1 && matcher_matches_zero(&matcher))
+		sparse = -1;
+	if (ring_init(&ring, matcher.height, opts)) {
+		ret = match_input(&ring, fd, NULL, &matcher, &sink,
+				opts->max_replacements, sparse);
+		ring_buf_destroy(&ring);
+	}
+	return ret;
+}
+
+bool substitute_in_place(const char *fn, pfx_tree_t substitutions,
+		const struct substitute_opts *opts)
+{
+	bool ret;
+	int fd = open(fn, O_RDWR);
+	if (fd == -1)
+		return false;
+	ret = substitute_in_place_fd(fd, substitutions, opts);
+	if (close(fd) == -1)
+		ret = false;
 	return ret;
 }
@@ -28,10 +28,80 @@
 #include <wchar.h>
 #include <stdbool.h>
 
+#include "codec.h"
 #include "pfx_tree.h"
 
+#define DEFAULT_BLOCK_SIZE (128 << 10)
+
+struct cache;
+struct dawg;
+
+/*
+ * The value stored for each needle in the substitution tree.
+ */
+struct substitution {
+	const char *replacement;
+	size_t replacement_len;
+	/* Position of the rule as given, indexes the per file match counts */
+	size_t id;
+	/* Most times the rule is applied to a file, 0 for no limit */
+	size_t max_replacements;
+};
+
+struct substitute_opts {
+	/* Size of the input ring and output buffer, rounded up to a power of two */
+	size_t block_size;
+	/* Back the buffers with huge pages when the system provides them */
+	bool huge_pages;
+	/*
+	 * Decompress gzip or zstd input before matching, otherwise it passes
+	 * through as the bytes it holds. Corrupt input fails with EBADMSG.
+	 */
+	bool decompress;
+	/* Format to compress the output with, if any */
+	enum codec compress;
+	/* Reuses earlier results for identical inputs when set */
+	struct cache *cache;
+	/* Stops matching after this many replacements in a file, 0 for no limit */
+	size_t max_replacements;
+	/* Matches with this automaton, built from the same tree, when set */
+	const struct dawg *dawg;
+	/* Cursors the matcher walks over the input in lockstep, 0 or 1 for one */
+	size_t lanes;
+	/*
+	 * Set by whoever builds the rules when every replacement is as long as
+	 * its needle, which patching in place requires
+	 */
+	bool same_length;
+};
+
+enum list_format {
+	LIST_TEXT = 0,
+	/* Little endian 64 bit offset, 32 bit rule id and 32 bit length */
+	LIST_BINARY,
+};
+
+#define LIST_RECORD_SIZE 16
+
 wchar_t *from_utf8(const char *str);
+bool parse_size(const char *str, size_t *size);
+bool write_all(int fd, const char *ptr, size_t count);
+bool copy_fd(int dest_fd, int src_fd, size_t len);
 bool substitute_file(const char *dest_fn, const char *src_fn,
-		pfx_tree_t substitutions, size_t longest_replacement);
+		pfx_tree_t substitutions, size_t longest_replacement,
+		const struct substitute_opts *opts);
+bool substitute_in_place(const char *fn, pfx_tree_t substitutions,
+		const struct substitute_opts *opts);
+bool list_matches(int out_fd, const char *src_fn, pfx_tree_t substitutions,
+		enum list_format format, const struct substitute_opts *opts);
+
+/*
+ * Work on already open files, as passed in by a client of the server.
+ * These never consult the cache, which is keyed by the destination path.
+ */
+bool substitute_fd(int dest_fd, int src_fd, pfx_tree_t substitutions,
+		size_t longest_replacement, const struct substitute_opts *opts);
+bool substitute_in_place_fd(int fd, pfx_tree_t substitutions,
+		const struct substitute_opts *opts);
 
 #endif // UTIL_H
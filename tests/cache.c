@@ -0,0 +1,277 @@
+/*
+ * cache.c: Test cases for the result cache
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../src/cache.h"
+#include "common.h"
+
+#define IN_FILE "util/in"
+#define SINGLE_FILE "util/single.out"
+
+static char cache_dir[] = "substitute_XXXXXX";
+static char out[] = "substitute_XXXXXX";
+
+static void rm_cache_dir()
+{
+	struct dirent *ent;
+	DIR *dir = opendir(cache_dir);
+	if (dir != NULL) {
+		while ((ent = readdir(dir)) != NULL)
+			unlinkat(dirfd(dir), ent->d_name, 0);
+		closedir(dir);
+	}
+	rmdir(cache_dir);
+	unlink(out);
+}
+
+static void tmp_init()
+{
+	ck_assert(mkdtemp(cache_dir) != NULL);
+	int fd = mkstemp(out);
+	ck_assert_int_ne(fd, -1);
+	close(fd);
+	atexit(rm_cache_dir);
+}
+
+static struct substitution rules[2];
+
+static void insert_rule(pfx_tree_t tree, const wchar_t *key, size_t id,
+		const char *val)
+{
+	rules[id].replacement = val;
+	rules[id].replacement_len = strlen(val);
+	rules[id].id = id;
+	rules[id].max_replacements = 0;
+	ck_assert(pfx_tree_insert_safe(tree, key, wcslen(key), &rules[id]));
+}
+
+static uint64_t hash_string(const char *str, size_t split)
+{
+	struct hash64 hash;
+	hash64_init(&hash, 0);
+	hash64_update(&hash, str, split);
+	hash64_update(&hash, str + split, strlen(str) - split);
+	return hash64_digest(&hash);
+}
+
+START_TEST(test_hash)
+{
+	char long_str[101];
+	memset(long_str, 'a', 100);
+	long_str[100] = '\0';
+
+	ck_assert(hash_string("", 0) == 0xef46db3751d8e999ULL);
+	ck_assert(hash_string("abc", 1) == 0x44bc2cf5ad770999ULL);
+	for (size_t split = 0; split <= 100; split += 7)
+		ck_assert(hash_string(long_str, split) == 0x375041e8b1decfb3ULL);
+}
+END_TEST
+
+static void assert_stats(struct cache *cache, const char *expected)
+{
+	char buf[256];
+	FILE *stats = tmpfile();
+	ck_assert(stats != NULL);
+	ck_assert(cache_print_stats(cache, stats));
+	rewind(stats);
+	ck_assert(fgets(buf, sizeof(buf), stats) != NULL);
+	ck_assert_int_eq(strncmp(buf, expected, strlen(expected)), 0);
+	fclose(stats);
+}
+
+static void cache_tester(const wchar_t *key, const char *val,
+		const char *expected_fn,
+		const char *hit_stats)
+{
+	pfx_tree_t tree = pfx_tree_init();
+	insert_rule(tree, key, 0, val);
+	struct substitute_opts opts = { .block_size = 0 };
+	opts.cache = cache_open(cache_dir, 1 << 20, tree, &opts);
+	ck_assert(opts.cache != NULL);
+
+	ck_assert(substitute_file(out, IN_FILE, tree, strlen(val), &opts));
+	assert_file_eq(out, expected_fn);
+	assert_stats(opts.cache, "Cache: 0 hits, 1 misses");
+
+	/* The second run must be served from the cache */
+	ck_assert_int_eq(truncate(out, 0), 0);
+	ck_assert(substitute_file(out, IN_FILE, tree, strlen(val), &opts));
+	assert_file_eq(out, expected_fn);
+	assert_stats(opts.cache, hit_stats);
+
+	cache_close(opts.cache);
+	pfx_tree_destroy(tree);
+}
+
+START_TEST(test_cache_hit)
+{
+	cache_tester(L"id", "hello", SINGLE_FILE,
+			"Cache: 1 hits, 1 misses (50.0% hit rate), 1 entries");
+}
+END_TEST
+
+START_TEST(test_cache_unchanged)
+{
+	/* Nothing matches so only a marker is stored, not a copy */
+	cache_tester(L"not in the input", "x", IN_FILE,
+			"Cache: 1 hits, 1 misses (50.0% hit rate), 1 entries using 0 bytes");
+}
+END_TEST
+
+START_TEST(test_cache_rules)
+{
+	pfx_tree_t tree1 = pfx_tree_init(), tree2 = pfx_tree_init();
+	struct substitute_opts opts = { .block_size = 0 };
+	insert_rule(tree1, L"id", 0, "hello");
+	insert_rule(tree2, L"id", 1, "world");
+
+	opts.cache = cache_open(cache_dir, 1 << 20, tree1, &opts);
+	ck_assert(opts.cache != NULL);
+	ck_assert(substitute_file(out, IN_FILE, tree1, 5, &opts));
+	cache_close(opts.cache);
+
+	/* Different rules must never share results */
+	opts.cache = cache_open(cache_dir, 1 << 20, tree2, &opts);
+	ck_assert(opts.cache != NULL);
+	ck_assert(substitute_file(out, IN_FILE, tree2, 5, &opts));
+	assert_stats(opts.cache, "Cache: 0 hits, 2 misses (0.0% hit rate), 2 entries");
+	cache_close(opts.cache);
+
+	pfx_tree_destroy(tree1);
+	pfx_tree_destroy(tree2);
+}
+END_TEST
+
+START_TEST(test_cache_evict)
+{
+	pfx_tree_t tree = pfx_tree_init();
+	struct substitute_opts opts = { .block_size = 0 };
+	insert_rule(tree, L"id", 0, "hello");
+
+	/* Temporaries of stores that crashed long ago are cleared out */
+	int dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+	ck_assert_int_ne(dir_fd, -1);
+	for (size_t i = 0; i < 2; ++i) {
+		int fd = openat(dir_fd, i == 0 ? "tmp.stale" : "tmp.live",
+				O_WRONLY | O_CREAT, 0666);
+		ck_assert_int_ne(fd, -1);
+		close(fd);
+	}
+	struct timespec old[2] = { { .tv_sec = time(NULL) - 7200 },
+		{ .tv_sec = time(NULL) - 7200 } };
+	ck_assert_int_eq(utimensat(dir_fd, "tmp.stale", old, 0), 0);
+
+	/* Too small to hold any result */
+	opts.cache = cache_open(cache_dir, 1, tree, &opts);
+	ck_assert(opts.cache != NULL);
+	ck_assert(substitute_file(out, IN_FILE, tree, 5, &opts));
+	assert_file_eq(out, SINGLE_FILE);
+	assert_stats(opts.cache, "Cache: 0 hits, 1 misses (0.0% hit rate), 0 entries");
+	cache_close(opts.cache);
+	ck_assert_int_eq(faccessat(dir_fd, "tmp.stale", F_OK, 0), -1);
+	ck_assert_int_eq(faccessat(dir_fd, "tmp.live", F_OK, 0), 0);
+	close(dir_fd);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+/*
+ * Moves the mtime of everything in the cache a minute back, so entries
+ * stored in quick succession still sort oldest first.
+ */
+static void age_entries()
+{
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir = opendir(cache_dir);
+	ck_assert(dir != NULL);
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.' ||
+				fstatat(dirfd(dir), ent->d_name, &st, 0) == -1)
+			continue;
+		st.st_mtim.tv_sec -= 60;
+		ck_assert_int_eq(utimensat(dirfd(dir), ent->d_name,
+					(struct timespec []) { st.st_atim, st.st_mtim }, 0), 0);
+	}
+	closedir(dir);
+}
+
+START_TEST(test_cache_evict_lru)
+{
+	static const char *vals[] = { "hello", "hellp", "hellq", "hello" };
+	struct substitute_opts opts = { .block_size = 0 };
+	char expected[128];
+	struct stat st;
+	ck_assert_int_eq(stat(SINGLE_FILE, &st), 0);
+
+	/*
+	 * Room for two results, so each store from the third on pushes out
+	 * the oldest, the first having to be made again by the last
+	 */
+	for (size_t i = 0; i < 4; ++i) {
+		pfx_tree_t tree = pfx_tree_init();
+		insert_rule(tree, L"id", 0, vals[i]);
+		opts.cache = cache_open(cache_dir, 2 * st.st_size + st.st_size / 2,
+				tree, &opts);
+		ck_assert(opts.cache != NULL);
+		ck_assert(substitute_file(out, IN_FILE, tree, 5, &opts));
+		if (i >= 2) {
+			snprintf(expected, sizeof(expected), "Cache: 0 hits, %zu misses "
+					"(0.0%% hit rate), 2 entries using %lld bytes",
+					i + 1, 2 * (long long)st.st_size);
+			assert_stats(opts.cache, expected);
+		}
+		cache_close(opts.cache);
+		pfx_tree_destroy(tree);
+		age_entries();
+	}
+	assert_file_eq(out, SINGLE_FILE);
+}
+END_TEST
+
+Suite *cache_suite()
+{
+	Suite *s = suite_create("Cache");
+	TCASE_ADD(s, "Hash", test_hash);
+	TCASE_ADD_CF(s, "Hit", test_cache_hit, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Unchanged", test_cache_unchanged, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Rules", test_cache_rules, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Evict", test_cache_evict, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Evict LRU", test_cache_evict_lru, tmp_init, NULL);
+	return s;
+}
+
+SRunner *srunner_generate()
+{
+	return srunner_create(cache_suite());
+}
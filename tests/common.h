@@ -25,7 +25,9 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
 #define TCASE_ADD_(suite, name, func)  \
@@ -41,6 +43,22 @@
 
 SRunner *srunner_generate();
 
+static inline void assert_file_eq(const char *fn1, const char *fn2)
+{
+	char buf1[4096], buf2[4096];
+	FILE *f1 = fopen(fn1, "r"), *f2 = fopen(fn2, "r");
+	size_t len1, len2;
+	ck_assert(f1 != NULL && f2 != NULL);
+	do {
+		len1 = fread(buf1, 1, sizeof(buf1), f1);
+		len2 = fread(buf2, 1, sizeof(buf2), f2);
+		ck_assert_int_eq(len1, len2);
+		ck_assert_int_eq(memcmp(buf1, buf2, len1), 0);
+	} while (len1 > 0);
+	fclose(f1);
+	fclose(f2);
+}
+
 int main(int argc, char *argv[])
 {
 	int nr_failed;
@@ -0,0 +1,154 @@
+/*
+ * dawg.c: Test cases for the minimized automaton
+ *
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <wchar.h>
+
+#include "../src/dawg.h"
+#include "common.h"
+
+static void *lookup(const struct dawg *dawg, const wchar_t *key)
+{
+	struct dawg_iter iter;
+	dawg_iter_init(dawg, &iter);
+	for (size_t i = 0; i < wcslen(key); ++i) {
+		if (!dawg_iter_next(dawg, &iter, dawg_fold_table(dawg)[key[i]]))
+			return NULL;
+		void *data = dawg_iter_data(dawg, &iter);
+		if (data != NULL)
+			return data;
+	}
+	return NULL;
+}
+
+START_TEST(test_empty)
+{
+	pfx_tree_t tree = pfx_tree_init();
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+	ck_assert_int_eq(dawg_height(dawg), 0);
+	ck_assert(lookup(dawg, L"a") == NULL);
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_suffixes)
+{
+	static const wchar_t *keys[] = {
+		L"/usr/lib/libfoo.so.1", L"/usr/lib/libbar.so.1",
+		L"/opt/lib/libfoo.so.1", L"/opt/lib/libbar.so.1",
+	};
+	static char values[4];
+	size_t tree_nodes = 0, tree_bytes = 0, nodes, edges, bytes;
+	pfx_tree_t tree = pfx_tree_init();
+	for (size_t i = 0; i < 4; ++i)
+		ck_assert(pfx_tree_insert_safe(tree, keys[i], wcslen(keys[i]),
+					&values[i]));
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+
+	for (size_t i = 0; i < 4; ++i)
+		ck_assert(lookup(dawg, keys[i]) == &values[i]);
+	ck_assert(lookup(dawg, L"/usr/lib/libbaz.so.1") == NULL);
+	ck_assert(lookup(dawg, L"/usr/lib") == NULL);
+	ck_assert_int_eq(dawg_height(dawg), wcslen(keys[0]));
+
+	/* Both directories share one /lib/lib chain, both names one .so.1 */
+	pfx_tree_stats(tree, &tree_nodes, &tree_bytes);
+	dawg_stats(dawg, &nodes, &edges, &bytes);
+	ck_assert_int_eq(tree_nodes, 56);
+	ck_assert_int_eq(nodes, 25);
+	ck_assert_int_eq(edges, 26);
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_ranks)
+{
+	/* Shared suffixes make the rank the only way back to the value */
+	static char values[1000];
+	wchar_t key[32];
+	pfx_tree_t tree = pfx_tree_init();
+	for (size_t i = 0; i < 1000; ++i) {
+		swprintf(key, 32, L"%zu.tar.gz", (i * 337) % 1000 + 1000);
+		ck_assert(pfx_tree_insert_safe(tree, key, wcslen(key), &values[i]));
+	}
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+
+	for (size_t i = 0; i < 1000; ++i) {
+		swprintf(key, 32, L"%zu.tar.gz", (i * 337) % 1000 + 1000);
+		ck_assert(lookup(dawg, key) == &values[i]);
+	}
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_icase)
+{
+	static char value;
+	pfx_tree_t tree = pfx_tree_init_flags(PFX_TREE_ICASE);
+	ck_assert(pfx_tree_insert_safe(tree, L"Hello", 5, &value));
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+	ck_assert(lookup(dawg, L"hELLO") == &value);
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_wide_chars)
+{
+	/* Keys no byte can match are left out rather than truncated */
+	static char values[2];
+	pfx_tree_t tree = pfx_tree_init();
+	ck_assert(pfx_tree_insert_safe(tree, L"a\x161", 2, &values[0]));
+	ck_assert(pfx_tree_insert_safe(tree, L"b", 1, &values[1]));
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+	ck_assert(lookup(dawg, L"aa") == NULL);
+	ck_assert(lookup(dawg, L"b") == &values[1]);
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+Suite *dawg_suite()
+{
+	Suite *s = suite_create("DAWG");
+	TCASE_ADD(s, "Empty", test_empty);
+	TCASE_ADD(s, "Suffixes", test_suffixes);
+	TCASE_ADD(s, "Ranks", test_ranks);
+	TCASE_ADD(s, "Ignore Case", test_icase);
+	TCASE_ADD(s, "Wide Characters", test_wide_chars);
+	return s;
+}
+
+SRunner *srunner_generate()
+{
+	return srunner_create(dawg_suite());
+}
@@ -105,6 +105,69 @@ START_TEST(test_height)
 	ck_assert(pfx_tree_insert_safe(tree, s1, wcslen(s1), "data"));
 	ck_assert(pfx_tree_insert_safe(tree, s2, wcslen(s2), "data"));
 	ck_assert_int_eq(pfx_tree_height(tree), wcslen(s2));
+	ck_assert(!pfx_tree_has_nul(tree));
+	ck_assert(pfx_tree_insert_safe(tree, L"a\0b", 3, "data"));
+	ck_assert(pfx_tree_has_nul(tree));
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_icase)
+{
+	wchar_t s1[] = L"Hello", s2[] = L"HELLO";
+	pfx_tree_t tree = pfx_tree_init_flags(PFX_TREE_ICASE);
+	const unsigned char *fold = pfx_tree_fold_table(tree);
+	ck_assert(pfx_tree_insert_safe(tree, s1, wcslen(s1), "data"));
+	ck_assert(!pfx_tree_insert_safe(tree, s2, wcslen(s2), "data"));
+	ck_assert_int_eq(fold['H'], 'h');
+	ck_assert_int_eq(fold['h'], 'h');
+	ck_assert_int_eq(fold['['], '[');
+	ck_assert_int_eq(fold[0xC8], 0xC8);
+	ck_assert_str_eq(get_str(tree, L"hello"), "data");
+	ck_assert(get_str(tree, L"HELLO") == NULL);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+static bool walk_cb(const wchar_t key[], size_t key_size, void *value,
+		void *data)
+{
+	size_t *count = data;
+	static const wchar_t *expected[] = { L"hello", L"hi", L"world" };
+	ck_assert_int_eq(key_size, wcslen(expected[*count]));
+	ck_assert_int_eq(wmemcmp(key, expected[*count], key_size), 0);
+	++*count;
+	return true;
+}
+
+START_TEST(test_walk)
+{
+	wchar_t s1[] = L"world", s2[] = L"hello", s3[] = L"hi";
+	size_t count = 0;
+	pfx_tree_t tree = pfx_tree_init();
+	ck_assert(pfx_tree_insert_safe(tree, s1, wcslen(s1), "data1"));
+	ck_assert(pfx_tree_insert_safe(tree, s2, wcslen(s2), "data2"));
+	ck_assert(pfx_tree_insert_safe(tree, s3, wcslen(s3), "data3"));
+	ck_assert(pfx_tree_walk(tree, walk_cb, &count));
+	ck_assert_int_eq(count, 3);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_wide)
+{
+	/* Enough siblings to grow the children array several times */
+	static char values[200];
+	wchar_t key[3] = { L'x', 0, 0 };
+	pfx_tree_t tree = pfx_tree_init();
+	for (size_t i = 0; i < 200; ++i) {
+		key[1] = L' ' + (i * 7) % 200;
+		ck_assert(pfx_tree_insert_safe(tree, key, 2, &values[i]));
+	}
+	for (size_t i = 0; i < 200; ++i) {
+		key[1] = L' ' + (i * 7) % 200;
+		ck_assert(get_str(tree, key) == &values[i]);
+	}
 	pfx_tree_destroy(tree);
 }
 END_TEST
@@ -118,6 +181,9 @@ Suite *pfx_tree_suite()
 	TCASE_ADD(s, "Same Prefix Forward", test_same_prefix_forward);
 	TCASE_ADD(s, "Same Prefix Backward", test_same_prefix_backward);
 	TCASE_ADD(s, "Height", test_height);
+	TCASE_ADD(s, "Ignore Case", test_icase);
+	TCASE_ADD(s, "Walk", test_walk);
+	TCASE_ADD(s, "Wide", test_wide);
 	return s;
 }
 
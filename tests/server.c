@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2014, William A. Kennington III
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../src/server.h"
+#include "common.h"
+
+#define IN_FILE "util/in"
+#define MULTI_FILE "util/multi.out"
+
+static char socket_dir[] = "substitute_XXXXXX";
+static char socket_fn[sizeof(socket_dir) + 8];
+static char out[] = "substitute_XXXXXX";
+
+static struct substitution rules[] = {
+	{ .replacement = "hello", .replacement_len = 5, .id = 0 },
+	{ .replacement = "world", .replacement_len = 5, .id = 1 },
+	{ .replacement = "foobar", .replacement_len = 6, .id = 2 },
+};
+static pfx_tree_t tree;
+static struct server *server;
+
+static void tmp_destroy()
+{
+	server_stop(server);
+	pfx_tree_destroy(tree);
+	unlink(out);
+	rmdir(socket_dir);
+}
+
+static void tmp_init()
+{
+	ck_assert(mkdtemp(socket_dir) != NULL);
+	snprintf(socket_fn, sizeof(socket_fn), "%s/sock", socket_dir);
+	int fd = mkstemp(out);
+	ck_assert_int_ne(fd, -1);
+	close(fd);
+
+	tree = pfx_tree_init();
+	ck_assert(pfx_tree_insert_safe(tree, L"id", 2, &rules[0]));
+	ck_assert(pfx_tree_insert_safe(tree, L"ipsum", 5, &rules[1]));
+	ck_assert(pfx_tree_insert_safe(tree, L"mattis", 6, &rules[2]));
+	server = server_start(socket_fn, 2, tree, 6, NULL);
+	ck_assert(server != NULL);
+	atexit(tmp_destroy);
+}
+
+START_TEST(test_server_paths)
+{
+	/* Relative paths must resolve against the client's directory */
+	struct server_file src = { .fn = IN_FILE, .fd = -1 };
+	struct server_file dest = { .fn = out, .fd = -1 };
+	ck_assert(server_submit(socket_fn, &src, &dest, false));
+	assert_file_eq(out, MULTI_FILE);
+}
+END_TEST
+
+START_TEST(test_server_fds)
+{
+	struct server_file src = { .fn = NULL, .fd = open(IN_FILE, O_RDONLY) };
+	struct server_file dest = { .fn = NULL, .fd = open(out, O_WRONLY) };
+	ck_assert_int_ne(src.fd, -1);
+	ck_assert_int_ne(dest.fd, -1);
+	ck_assert(server_submit(socket_fn, &src, &dest, false));
+	close(src.fd);
+	close(dest.fd);
+	assert_file_eq(out, MULTI_FILE);
+
+	/* Named and passed files can be mixed */
+	ck_assert_int_eq(truncate(out, 0), 0);
+	src.fd = open(IN_FILE, O_RDONLY);
+	dest = (struct server_file) { .fn = out, .fd = -1 };
+	ck_assert(server_submit(socket_fn, &src, &dest, false));
+	close(src.fd);
+	assert_file_eq(out, MULTI_FILE);
+}
+END_TEST
+
+START_TEST(test_server_errors)
+{
+	struct server_file src = { .fn = "does/not/exist", .fd = -1 };
+	struct server_file dest = { .fn = out, .fd = -1 };
+	ck_assert(!server_submit(socket_fn, &src, &dest, false));
+	ck_assert_int_eq(errno, ENOENT);
+
+	/* The replacements differ in length from their needles */
+	src.fn = out;
+	ck_assert(!server_submit(socket_fn, &src, NULL, true));
+	ck_assert_int_eq(errno, EINVAL);
+
+	/* A running server keeps its socket */
+	ck_assert(server_start(socket_fn, 1, tree, 6, NULL) == NULL);
+	ck_assert_int_eq(errno, EADDRINUSE);
+	src.fn = IN_FILE;
+	ck_assert(server_submit(socket_fn, &src, &dest, false));
+	assert_file_eq(out, MULTI_FILE);
+}
+END_TEST
+
+START_TEST(test_server_restart)
+{
+	struct server_file src = { .fn = IN_FILE, .fd = -1 };
+	struct server_file dest = { .fn = out, .fd = -1 };
+
+	server_stop(server);
+	server = NULL;
+	ck_assert(!server_submit(socket_fn, &src, &dest, false));
+	server = server_start(socket_fn, 1, tree, 6, NULL);
+	ck_assert(server != NULL);
+	ck_assert(server_submit(socket_fn, &src, &dest, false));
+	assert_file_eq(out, MULTI_FILE);
+}
+END_TEST
+
+START_TEST(test_server_peers)
+{
+	struct server_file src = { .fn = IN_FILE, .fd = -1 };
+	struct server_file dest = { .fn = out, .fd = -1 };
+	struct stat st;
+	int status;
+
+	ck_assert_int_eq(stat(socket_fn, &st), 0);
+	ck_assert_int_eq(st.st_mode & 0777, 0600);
+
+	/* Only root can act as another user to check it is turned away */
+	if (geteuid() != 0)
+		return;
+	ck_assert_int_eq(chmod(socket_dir, 0711), 0);
+	ck_assert_int_eq(chmod(socket_fn, 0666), 0);
+	pid_t pid = fork();
+	ck_assert_int_ne(pid, -1);
+	if (pid == 0) {
+		if (setuid(65534) == -1)
+			_exit(2);
+		_exit(!server_submit(socket_fn, &src, &dest, false) &&
+				errno == EACCES ? 0 : 1);
+	}
+	ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+	ck_assert(WIFEXITED(status));
+	ck_assert_int_eq(WEXITSTATUS(status), 0);
+}
+END_TEST
+
+SRunner *srunner_generate()
+{
+	Suite *s = suite_create("Server");
+	TCASE_ADD_CF(s, "Paths", test_server_paths, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Descriptors", test_server_fds, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Errors", test_server_errors, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Restart", test_server_restart, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Peers", test_server_peers, tmp_init, NULL);
+	return srunner_create(s);
+}
@@ -22,13 +22,20 @@
  * THE SOFTWARE.
  */
 
+#include "config.h"
+
 #include <locale.h>
+#include <endian.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
+#include "../src/dawg.h"
 #include "../src/util.h"
 #include "common.h"
 
@@ -93,24 +100,25 @@ static void tmp_init()
 	atexit(tmp_destroy);
 }
 
-static void assert_file_eq(int fd1, int fd2)
+static void assert_fd_eq(int fd1, int fd2)
 {
 	uint8_t buf1[BUF_SIZE], buf2[BUF_SIZE];
-	bool init = true;
+	bool progress;
 	size_t off1 = 0, off2 = 0;
 
-	while (true) {
+	/* Reads until neither file has more, comparing what both have so far */
+	do {
 #define READ(num) {                                                            \
 			ssize_t bytes##num = read(fd##num, buf##num + off##num,            \
 					BUF_SIZE - off##num);                                      \
 			ck_assert_int_ne(bytes##num, -1);                                  \
-			if (!init && bytes##num + off##num != 0)                           \
-				break;                                                         \
 			off##num += bytes##num;                                            \
+			progress = progress || bytes##num > 0;                             \
 		}
+		progress = false;
 		READ(1);
 		READ(2);
-		init = false;
+#undef READ
 
 		size_t min = off1 < off2 ? off1 : off2;
 		ck_assert_int_eq(memcmp(buf1, buf2, min), 0);
@@ -119,7 +127,7 @@ static void assert_file_eq(int fd1, int fd2)
 		memmove(buf1, buf1 + min, off1);
 		off2 -= min;
 		memmove(buf2, buf2 + min, off2);
-	}
+	} while (progress);
 	ck_assert_int_eq(off1, 0);
 	ck_assert_int_eq(off2, 0);
 }
@@ -127,29 +135,74 @@ static void assert_file_eq(int fd1, int fd2)
 struct subs {
 	wchar_t *key;
 	char *val;
+	size_t max;
 };
 
-static void substitute_tester(const char *expected_fn,
-		const struct subs *substitutes)
+static const struct subs multi_subs[] = {
+	{ .key = L"id", .val = "hello" },
+	{ .key = L"ipsum", .val = "world" },
+	{ .key = L"mattis", .val = "foobar" },
+	{ .key = NULL, .val = NULL },
+};
+
+#define MAX_RULES 8
+
+static struct substitution rules[MAX_RULES];
+
+static pfx_tree_t build_tree(const struct subs *substitutes,
+		unsigned flags, size_t *longest_sub)
 {
-	size_t longest_sub = 0;
-	pfx_tree_t tree = pfx_tree_init();
-	while (substitutes[0].key != NULL) {
-		ck_assert(pfx_tree_insert_safe(tree, substitutes[0].key,
-					wcslen(substitutes[0].key), substitutes[0].val));
-		size_t sub_len = strlen(substitutes[0].val);
-		if (sub_len > longest_sub)
-			longest_sub = sub_len;
-		++substitutes;
+	pfx_tree_t tree = pfx_tree_init_flags(flags);
+	*longest_sub = 0;
+	for (size_t i = 0; substitutes[i].key != NULL; ++i) {
+		ck_assert_int_lt(i, MAX_RULES);
+		rules[i].replacement = substitutes[i].val;
+		rules[i].replacement_len = strlen(substitutes[i].val);
+		rules[i].id = i;
+		rules[i].max_replacements = substitutes[i].max;
+		ck_assert(pfx_tree_insert_safe(tree, substitutes[i].key,
+					wcslen(substitutes[i].key), &rules[i]));
+		if (rules[i].replacement_len > *longest_sub)
+			*longest_sub = rules[i].replacement_len;
 	}
-	ck_assert(substitute_file(out, IN_FILE, tree, longest_sub));
+	return tree;
+}
+
+static bool same_length(const struct subs *substitutes)
+{
+	for (size_t i = 0; substitutes[i].key != NULL; ++i)
+		if (wcslen(substitutes[i].key) != strlen(substitutes[i].val))
+			return false;
+	return true;
+}
+
+static void substitute_tester_flags(const char *expected_fn,
+		const char *src_fn, const struct subs *substitutes, unsigned flags,
+		const struct substitute_opts *opts)
+{
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(substitutes, flags, &longest_sub);
+	ck_assert(substitute_file(out, src_fn, tree, longest_sub, opts));
 	int expected_fd = open(expected_fn, 0);
 	ck_assert_int_ne(expected_fd, -1);
-	assert_file_eq(out_fd, expected_fd);
+	assert_fd_eq(out_fd, expected_fd);
 	close(expected_fd);
 	pfx_tree_destroy(tree);
 }
 
+static void substitute_tester_opts(const char *expected_fn,
+		const char *src_fn, const struct subs *substitutes,
+		const struct substitute_opts *opts)
+{
+	substitute_tester_flags(expected_fn, src_fn, substitutes, 0, opts);
+}
+
+static void substitute_tester(const char *expected_fn,
+		const struct subs *substitutes)
+{
+	substitute_tester_opts(expected_fn, IN_FILE, substitutes, NULL);
+}
+
 START_TEST(test_substitute_none)
 {
 	substitute_tester(IN_FILE, (struct subs []) {
@@ -178,12 +231,381 @@ START_TEST(test_substitute_multi)
 }
 END_TEST
 
+START_TEST(test_substitute_small_block)
+{
+	/* Forces matches to straddle reads and wrap around the ring */
+	substitute_tester_opts("util/multi.out", IN_FILE, multi_subs,
+			&(struct substitute_opts) { .block_size = 7 });
+
+	/* The sniffed magic bytes must not leave a tiny ring full */
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	substitute_tester_opts(IN_FILE, IN_FILE, (struct subs []) {
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .block_size = 2 });
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	substitute_tester_opts(IN_FILE, IN_FILE, (struct subs []) {
+			{ .key = L"o", .val = "o" },
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .block_size = 2 });
+}
+END_TEST
+
+static const struct subs icase_subs[] = {
+	{ .key = L"LoReM", .val = "hello" },
+	{ .key = L"nunc", .val = "world" },
+	{ .key = NULL, .val = NULL },
+};
+
+START_TEST(test_substitute_icase)
+{
+	substitute_tester_flags("util/icase.out", IN_FILE, icase_subs,
+			PFX_TREE_ICASE, NULL);
+}
+END_TEST
+
+#ifdef HAVE_ZLIB
+START_TEST(test_substitute_gzip_input)
+{
+	char buf[BUF_SIZE];
+	ssize_t bytes;
+	int src_fd = open(IN_FILE, O_RDONLY);
+	ck_assert_int_ne(src_fd, -1);
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+
+	gzFile gz = gzdopen(dup(in_fd), "wb");
+	ck_assert(gz != NULL);
+	while ((bytes = read(src_fd, buf, BUF_SIZE)) > 0)
+		ck_assert_int_eq(gzwrite(gz, buf, bytes), bytes);
+	ck_assert_int_eq(gzclose(gz), Z_OK);
+	close(src_fd);
+
+	substitute_tester_opts("util/multi.out", in, multi_subs,
+			&(struct substitute_opts) { .decompress = true });
+
+	/* Left alone unless asked, compressed input passes through as is */
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	substitute_tester_opts(in, in, (struct subs []) {
+			{ .key = NULL, .val = NULL },
+	}, NULL);
+}
+END_TEST
+
+START_TEST(test_substitute_gzip_magic)
+{
+	pfx_tree_t tree = pfx_tree_init();
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+
+	/* Too short to be gzip, so plain bytes that merely start alike */
+	ck_assert_int_eq(write(in_fd, "\x1f\x8b", 2), 2);
+	substitute_tester_opts(in, in, (struct subs []) {
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .decompress = true });
+
+	/* A gzip header over data that does not inflate */
+	ck_assert_int_eq(write(in_fd, "\x08\x00 not deflate data", 20), 20);
+	ck_assert(!substitute_file(out, in, tree, 0,
+				&(struct substitute_opts) { .decompress = true }));
+	ck_assert_int_eq(errno, EBADMSG);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+#endif
+
+static void compress_tester(enum codec codec)
+{
+	unsigned char magic[CODEC_MAGIC_LEN];
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+
+	ck_assert(substitute_file(in, IN_FILE, tree, longest_sub,
+				&(struct substitute_opts) { .compress = codec }));
+	ck_assert_int_eq(read(in_fd, magic, CODEC_MAGIC_LEN), CODEC_MAGIC_LEN);
+	ck_assert_int_eq(codec_detect(magic, CODEC_MAGIC_LEN), codec);
+	pfx_tree_destroy(tree);
+
+	/* Reading the output back decompresses it */
+	substitute_tester_opts("util/multi.out", in, (struct subs []) {
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .decompress = true });
+}
+
+#ifdef HAVE_ZLIB
+START_TEST(test_substitute_gzip_output)
+{
+	compress_tester(CODEC_GZIP);
+}
+END_TEST
+#endif
+
+#ifdef HAVE_ZSTD
+START_TEST(test_substitute_zstd_output)
+{
+	compress_tester(CODEC_ZSTD);
+}
+END_TEST
+#endif
+
+START_TEST(test_substitute_dawg)
+{
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(icase_subs, PFX_TREE_ICASE, &longest_sub);
+	struct dawg *dawg = dawg_build(tree);
+	ck_assert(dawg != NULL);
+
+	ck_assert(substitute_file(out, IN_FILE, tree, longest_sub,
+				&(struct substitute_opts) { .block_size = 7, .dawg = dawg }));
+	int expected_fd = open("util/icase.out", 0);
+	ck_assert_int_ne(expected_fd, -1);
+	assert_fd_eq(out_fd, expected_fd);
+	close(expected_fd);
+	dawg_destroy(dawg);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_substitute_max)
+{
+	substitute_tester_opts("util/limit.out", IN_FILE, multi_subs,
+			&(struct substitute_opts) { .max_replacements = 5 });
+}
+END_TEST
+
+START_TEST(test_substitute_rule_max)
+{
+	substitute_tester_opts("util/rule_limit.out", IN_FILE, (struct subs []) {
+			{ .key = L"id", .val = "hello", .max = 2 },
+			{ .key = L"ipsum", .val = "world" },
+			{ .key = L"mattis", .val = "foobar", .max = 1 },
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .block_size = 7 });
+}
+END_TEST
+
+START_TEST(test_substitute_interleave)
+{
+	/* Slices smaller and larger than the blocks must give the same output */
+	substitute_tester_opts("util/multi.out", IN_FILE, multi_subs,
+			&(struct substitute_opts) { .block_size = 7, .lanes = 3 });
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	substitute_tester_opts("util/multi.out", IN_FILE, multi_subs,
+			&(struct substitute_opts) { .lanes = 16 });
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	substitute_tester_opts("util/rule_limit.out", IN_FILE, (struct subs []) {
+			{ .key = L"id", .val = "hello", .max = 2 },
+			{ .key = L"ipsum", .val = "world" },
+			{ .key = L"mattis", .val = "foobar", .max = 1 },
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .block_size = 7, .lanes = 4 });
+}
+END_TEST
+
+#ifdef HAVE_ZLIB
+START_TEST(test_substitute_max_compressed)
+{
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+
+	/* The remainder goes through the codec threads rather than the kernel */
+	ck_assert(substitute_file(in, IN_FILE, tree, longest_sub,
+				&(struct substitute_opts) {
+					.compress = CODEC_GZIP, .max_replacements = 5 }));
+	pfx_tree_destroy(tree);
+
+	/* Decompressing stops matching early too */
+	substitute_tester_opts("util/limit.out", in, (struct subs []) {
+			{ .key = L"hello", .val = "hello" },
+			{ .key = NULL, .val = NULL },
+	}, &(struct substitute_opts) { .decompress = true,
+			.max_replacements = 1 });
+}
+END_TEST
+#endif
+
+static void copy_in_file()
+{
+	char buf[BUF_SIZE];
+	ssize_t bytes;
+	int src_fd = open(IN_FILE, O_RDONLY);
+	ck_assert_int_ne(src_fd, -1);
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+	while ((bytes = read(src_fd, buf, BUF_SIZE)) > 0)
+		ck_assert_int_eq(write(in_fd, buf, bytes), bytes);
+	close(src_fd);
+}
+
+START_TEST(test_substitute_in_place)
+{
+	static const struct subs patch_subs[] = {
+		{ .key = L"id", .val = "ID" },
+		{ .key = L"ipsum", .val = "IPSUM" },
+		{ .key = L"mattis", .val = "sittam" },
+		{ .key = NULL, .val = NULL },
+	};
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(patch_subs, 0, &longest_sub);
+	copy_in_file();
+
+	ck_assert(substitute_in_place(in, tree, &(struct substitute_opts) {
+				.block_size = 7,
+				.same_length = same_length(patch_subs) }));
+	int expected_fd = open("util/patch.out", 0);
+	ck_assert_int_ne(expected_fd, -1);
+	ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+	assert_fd_eq(in_fd, expected_fd);
+	close(expected_fd);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_substitute_in_place_length)
+{
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+	copy_in_file();
+
+	ck_assert(!substitute_in_place(in, tree, &(struct substitute_opts) {
+				.same_length = same_length(multi_subs) }));
+	ck_assert_int_eq(errno, EINVAL);
+	int expected_fd = open(IN_FILE, 0);
+	ck_assert_int_ne(expected_fd, -1);
+	ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+	assert_fd_eq(in_fd, expected_fd);
+	close(expected_fd);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_list_matches)
+{
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+	ck_assert(list_matches(out_fd, IN_FILE, tree, LIST_TEXT, NULL));
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	int expected_fd = open("util/list.out", 0);
+	ck_assert_int_ne(expected_fd, -1);
+	assert_fd_eq(out_fd, expected_fd);
+	close(expected_fd);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+START_TEST(test_list_matches_binary)
+{
+	unsigned char record[LIST_RECORD_SIZE];
+	size_t longest_sub, offset, id, len, count = 0;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+	FILE *expected = fopen("util/list.out", "r");
+	ck_assert(expected != NULL);
+
+	/* Limits apply to listing just as they do to replacing */
+	ck_assert(list_matches(out_fd, IN_FILE, tree, LIST_BINARY,
+				&(struct substitute_opts) {
+					.block_size = 7,
+					.max_replacements = 10,
+				}));
+	ck_assert_int_eq(lseek(out_fd, 0, SEEK_SET), 0);
+	while (read(out_fd, record, sizeof(record)) == sizeof(record)) {
+		ck_assert_int_eq(fscanf(expected, "%zu\t%zu\t%zu\n",
+					&offset, &id, &len), 3);
+		ck_assert_int_eq(le64toh(*(uint64_t *)record), offset);
+		ck_assert_int_eq(le32toh(*(uint32_t *)(record + 8)), id);
+		ck_assert_int_eq(le32toh(*(uint32_t *)(record + 12)), len);
+		++count;
+	}
+	ck_assert_int_eq(count, 10);
+	fclose(expected);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
+#define HOLE_SIZE (1 << 20)
+
+static void check_range(int fd, off_t offset, const char *expected,
+		size_t len)
+{
+	char buf[BUF_SIZE];
+	ck_assert_int_lt(len, BUF_SIZE);
+	ck_assert_int_eq(pread(fd, buf, len, offset), len);
+	ck_assert_int_eq(memcmp(buf, expected, len), 0);
+}
+
+START_TEST(test_substitute_sparse)
+{
+	static const char zeros[16];
+	struct stat st;
+	size_t longest_sub;
+	pfx_tree_t tree = build_tree(multi_subs, 0, &longest_sub);
+
+	/* A partial match before the hole must not continue after it */
+	in_fd = mkstemp(in);
+	ck_assert_int_ne(in_fd, -1);
+	ck_assert_int_eq(write(in_fd, "id text i", 9), 9);
+	ck_assert_int_ne(lseek(in_fd, HOLE_SIZE, SEEK_CUR), -1);
+	ck_assert_int_eq(write(in_fd, "d ipsum mattis", 14), 14);
+	ck_assert_int_eq(ftruncate(in_fd, 2*HOLE_SIZE + 23), 0);
+
+	ck_assert(substitute_file(out, in, tree, longest_sub,
+				&(struct substitute_opts) { .block_size = 7 }));
+	ck_assert_int_eq(fstat(out_fd, &st), 0);
+	ck_assert_int_eq(st.st_size, 2*HOLE_SIZE + 26);
+	check_range(out_fd, 0, "hello text i", 12);
+	check_range(out_fd, 12, zeros, sizeof(zeros));
+	check_range(out_fd, HOLE_SIZE + 12, "d world foobar", 14);
+	check_range(out_fd, st.st_size - sizeof(zeros), zeros, sizeof(zeros));
+
+	/* Only expect holes in the output where the input has them */
+	ck_assert_int_eq(fstat(in_fd, &st), 0);
+	if (st.st_blocks * 512 < HOLE_SIZE) {
+		ck_assert_int_eq(fstat(out_fd, &st), 0);
+		ck_assert_int_lt(st.st_blocks * 512, HOLE_SIZE);
+	}
+
+	/* A needle holding a NUL can match into a hole, so it is read */
+	struct substitution nul_sub = { .replacement = "I!",
+		.replacement_len = 2 };
+	pfx_tree_t nul_tree = pfx_tree_init();
+	ck_assert(pfx_tree_insert_safe(nul_tree, L"i\0", 2, &nul_sub));
+	ck_assert(substitute_file(out, in, nul_tree, 2, NULL));
+	pfx_tree_destroy(nul_tree);
+	ck_assert_int_eq(fstat(out_fd, &st), 0);
+	ck_assert_int_eq(st.st_size, 2*HOLE_SIZE + 23);
+	check_range(out_fd, 0, "id text I!", 10);
+	check_range(out_fd, 10, zeros, sizeof(zeros));
+
+	/* Outputs that cannot take holes get them written out as zeros */
+	int null_fd = open("/dev/null", O_WRONLY);
+	ck_assert_int_ne(null_fd, -1);
+	ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+	ck_assert(substitute_fd(null_fd, in_fd, tree, longest_sub, NULL));
+	close(null_fd);
+
+	int append_fd = open(out, O_WRONLY | O_TRUNC | O_APPEND);
+	ck_assert_int_ne(append_fd, -1);
+	ck_assert_int_eq(write(append_fd, "x", 1), 1);
+	ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+	ck_assert(substitute_fd(append_fd, in_fd, tree, longest_sub, NULL));
+	close(append_fd);
+	ck_assert_int_eq(fstat(out_fd, &st), 0);
+	ck_assert_int_eq(st.st_size, 2*HOLE_SIZE + 27);
+	check_range(out_fd, 1, "hello text i", 12);
+	check_range(out_fd, HOLE_SIZE + 13, "d world foobar", 14);
+	pfx_tree_destroy(tree);
+}
+END_TEST
+
 START_TEST(test_substitute_bad_input)
 {
 	pfx_tree_t tree = pfx_tree_init();
 	struct stat before, after;
 	ck_assert_int_eq(stat(out, &before), 0);
-	ck_assert(!substitute_file(out, "does/not/exist", tree, 0));
+	ck_assert(!substitute_file(out, "does/not/exist", tree, 0, NULL));
 	ck_assert_int_eq(stat(out, &after), 0);
 	ck_assert(before.st_ctime == after.st_ctime);
 	ck_assert(before.st_mtime == after.st_mtime);
@@ -191,12 +613,65 @@ START_TEST(test_substitute_bad_input)
 }
 END_TEST
 
+START_TEST(test_parse_size)
+{
+	size_t size;
+	ck_assert(parse_size("4096", &size));
+	ck_assert_int_eq(size, 4096);
+	ck_assert(parse_size("64K", &size));
+	ck_assert_int_eq(size, 64 << 10);
+	ck_assert(parse_size("4m", &size));
+	ck_assert_int_eq(size, 4 << 20);
+	ck_assert(!parse_size("0", &size));
+	ck_assert(!parse_size("12Q", &size));
+	ck_assert(!parse_size("", &size));
+}
+END_TEST
+
+Suite *parse_size_suite()
+{
+	Suite *s = suite_create("Parse Size");
+	TCASE_ADD(s, "Suffixes", test_parse_size);
+	return s;
+}
+
 Suite *substitute_suite()
 {
 	Suite *s = suite_create("Substitute");
 	TCASE_ADD_CF(s, "None", test_substitute_none, tmp_init, NULL);
 	TCASE_ADD_CF(s, "Single", test_substitute_single, tmp_init, NULL);
 	TCASE_ADD_CF(s, "Multi", test_substitute_multi, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Small Block", test_substitute_small_block,
+			tmp_init, NULL);
+	TCASE_ADD_CF(s, "Ignore Case", test_substitute_icase, tmp_init, NULL);
+#ifdef HAVE_ZLIB
+	TCASE_ADD_CF(s, "Gzip Input", test_substitute_gzip_input,
+			tmp_init, NULL);
+	TCASE_ADD_CF(s, "Gzip Output", test_substitute_gzip_output,
+			tmp_init, NULL);
+	TCASE_ADD_CF(s, "Gzip Magic", test_substitute_gzip_magic,
+			tmp_init, NULL);
+#endif
+#ifdef HAVE_ZSTD
+	TCASE_ADD_CF(s, "Zstd Output", test_substitute_zstd_output,
+			tmp_init, NULL);
+#endif
+	TCASE_ADD_CF(s, "DAWG", test_substitute_dawg, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Max Replacements", test_substitute_max, tmp_init, NULL);
+	TCASE_ADD_CF(s, "Max Rule Replacements", test_substitute_rule_max,
+			tmp_init, NULL);
+	TCASE_ADD_CF(s, "Interleave", test_substitute_interleave, tmp_init, NULL);
+#ifdef HAVE_ZLIB
+	TCASE_ADD_CF(s, "Max Replacements Compressed",
+			test_substitute_max_compressed, tmp_init, NULL);
+#endif
+	TCASE_ADD_CF(s, "In Place", test_substitute_in_place, tmp_init, NULL);
+	TCASE_ADD_CF(s, "In Place Length", test_substitute_in_place_length,
+			tmp_init, NULL);
+	TCASE_ADD_CF(s, "Sparse", test_substitute_sparse, tmp_init, NULL);
+	TCASE_ADD_CF(s, "List Matches", test_list_matches, tmp_init, NULL);
+	TCASE_ADD_CF(s, "List Matches Binary", test_list_matches_binary,
+			tmp_init, NULL);
 	TCASE_ADD_CF(s, "Bad Input", test_substitute_bad_input,
 			tmp_init, NULL);
 	return s;
@@ -205,6 +680,7 @@ Suite *substitute_suite()
 SRunner *srunner_generate()
 {
 	SRunner *sr = srunner_create(utf8_suite());
+	srunner_add_suite(sr, parse_size_suite());
 	srunner_add_suite(sr, substitute_suite());
 	return sr;
 }